@@ -1,41 +1,72 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "alosum.h"
 #include "prng.h"
 #include "math.h"
-#include <windows.h>
+#include "quantile.h"
+#include "handoff.h"
+#include <type_traits>
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define ALS_PREFETCH(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+#define ALS_PREFETCH(p) __builtin_prefetch(p)
+#endif
 
+#define ALS_PREFETCH_DISTANCE 8 // items hashed ahead by ALS_UpdateBatch, a power of 2
 
-#define ALS_NULLITEM 0x7FFFFFFF
-#define swap(x,y) do{int t=x; x=y; y=t;} while(0)
 
-void ALS_InitPassive(ALS_type *ALS) {
-	ALS->passiveCounters =
-		(ALSCounter*)calloc(ALS->size, sizeof(ALSCounter));
-	ALS->passiveHashtable =
-		(ALSCounter **)calloc(ALS->hashsize, sizeof(ALSCounter*));
-	for (int i = 0; i < ALS->hashsize; ++i) {
-		ALS->passiveHashtable[i] = NULL;
+/*
+Returns a new epoch for table, which empties it.
+*/
+template<class S>
+static unsigned int ALS_NewEpoch(S *ALS, ALSBucket * table, int hashsize) {
+	if (++(ALS->epoch) == 0) {
+		// The epochs are reused from here on, and any table may still have
+		// old buckets with them. The tables are cleared in turn, so each is
+		// wiped at its next clear.
+		ALS->epoch = 1;
+		ALS->wrapClears = ALS->background ? 4 : 2;
 	}
-	for (int i = 0; i < ALS->size; i++)
-	{
-		ALS->passiveCounters[i].next = NULL;
-		ALS->passiveCounters[i].prev = NULL;
-		ALS->passiveCounters[i].item = ALS_NULLITEM;
-		// initialize items and counters to zero
+	if (ALS->wrapClears > 0) {
+		memset(table, 0, hashsize * sizeof(ALSBucket));
+		--(ALS->wrapClears);
 	}
+	return ALS->epoch;
+}
+
+/*
+Empty the passive counters and table. Counters past nPassive are never
+read, and the table is emptied by giving it a new epoch, so nothing is
+freed, allocated or written here.
+*/
+template<class S>
+void ALS_ClearPassive(S *ALS) {
+	ALS->passiveEpoch = ALS_NewEpoch(ALS, ALS->passiveHashtable, ALS->hashsize);
 	ALS->nPassive = 0;
 }
 
-ALS_type * ALS_Init(float fPhi, float gamma)
+/*
+The first counter in the chain of bucket, which is in a table of epoch
+epoch with the given counters, or NULL if the chain is empty.
+*/
+template<class Counter>
+static inline Counter * ALS_ChainHead(ALSBucket * bucket, Counter * counters,
+	unsigned int epoch) {
+	return (bucket->epoch == epoch) ? &counters[bucket->head] : NULL;
+}
+
+template<class S>
+S * ALS_Init(float fPhi, float gamma)
 {
-	int i;
 	int k = 1 + (int) 1.0 / fPhi;
 
-	ALS_type *result = (ALS_type *)calloc(1, sizeof(ALS_type));
+	S *result = (S *)calloc(1, sizeof(S));
 	// needs to be odd so that the heap always has either both children or 
 	// no children present in the data structure
 	result->epsilon = fPhi;
+	result->gamma = gamma;
 	// nitems in large table
 	result->nActive = 0;
 	result->size = int(ceil(gamma / fPhi) + ceil(1 / fPhi) - 1);// - 1);
@@ -45,117 +76,236 @@ ALS_type * ALS_Init(float fPhi, float gamma)
 	result->hasha = 151261303;
 	result->hashb = 6722461; // hard coded constants for the hash table,
 							 //should really generate these randomly
-	result->n = (ALSweight_t)0;
+	result->n = (typename S::Weight)0;
 
+	// Both arenas live as long as the summary. calloc leaves every bucket
+	// at epoch 0, which no table ever has.
 	result->activeHashtable =
-		(ALSCounter **)calloc(result->hashsize, sizeof(ALSCounter*));
-	for (i = 0; i < result->hashsize; ++i) {
-		result->activeHashtable[i] = NULL;
-	}
+		(ALSBucket *)calloc(result->hashsize, sizeof(ALSBucket));
 	result->activeCounters =
-		(ALSCounter*)calloc(result->size, sizeof(ALSCounter));
-	for (i = 0; i < result->size; i++)
-	{
-		result->activeCounters[i].next = NULL;
-		result->activeCounters[i].prev = NULL;
-		result->activeCounters[i].item = ALS_NULLITEM;
-		// initialize items and counters to zero
-	}
-
-	ALS_InitPassive(result);
+		(typename S::Counter*)calloc(result->size, sizeof(typename S::Counter));
+	result->passiveHashtable =
+		(ALSBucket *)calloc(result->hashsize, sizeof(ALSBucket));
+	result->passiveCounters =
+		(typename S::Counter*)calloc(result->size, sizeof(typename S::Counter));
+	result->activeEpoch = 1;
+	result->passiveEpoch = 2;
+	result->epoch = 2;
+	result->wrapClears = 0;
+	result->nPassive = 0;
 	result->extra = result->size;
 	result->quantile = 0;
 	result->buffer =
-		(int*)calloc(result->size, sizeof(int));
-	result->handle = NULL;
+		(typename S::Weight*)calloc(result->size, sizeof(typename S::Weight));
+	result->scratch =
+		(typename S::Weight*)calloc(result->size, sizeof(typename S::Weight));
 	return(result);
 }
 
-void ALS_DestroyPassive(ALS_type* ALS) {
-	free(ALS->passiveHashtable);
-	free(ALS->passiveCounters);
+template<class S>
+void ALS_BackgroundMaintenance(S* ALS);
+
+/*
+IMSum whose maintenance runs on a thread of its own, for when a core can
+be spared for it. A restart only switches arrays, and the thread then
+selects the new quantile among the passive counters, which no longer
+change, and copies the ones above it aside, while updates go on in the
+active table. Items above the quantile are thus kept in a third table
+instead of being moved back into the active one, so the update thread
+stays its only writer. The selected quantile and the copied counters are
+installed at the next restart, so queries see maintenance one round late,
+with estimates that are still upper bounds. The update thread only waits
+if it fills the active table before the round is over.
+*/
+template<class S>
+S * ALS_InitBackground(float fPhi, float gamma)
+{
+	S *result = ALS_Init<S>(fPhi, gamma);
+	result->background = true;
+	result->survivorsSize = int(ceil(1 / fPhi));
+	result->survivorsHashsize = ALS_HASHMULT*result->survivorsSize;
+	result->survivorCounters =
+		(typename S::Counter*)calloc(result->survivorsSize, sizeof(typename S::Counter));
+	result->nextSurvivorCounters =
+		(typename S::Counter*)calloc(result->survivorsSize, sizeof(typename S::Counter));
+	result->survivorHashtable =
+		(ALSBucket *)calloc(result->survivorsHashsize, sizeof(ALSBucket));
+	result->nextSurvivorHashtable =
+		(ALSBucket *)calloc(result->survivorsHashsize, sizeof(ALSBucket));
+	result->survivorsEpoch = ++(result->epoch);
+	result->nextSurvivorsEpoch = ++(result->epoch);
+	result->nSurvivors = 0;
+	result->nNextSurvivors = 0;
+	result->nextQuantile = 0;
+	// the selection runs over the passive counters and the survivors
+	free(result->buffer);
+	free(result->scratch);
+	result->buffer =
+		(typename S::Weight*)calloc(result->size + result->survivorsSize, sizeof(typename S::Weight));
+	result->scratch =
+		(typename S::Weight*)calloc(result->size + result->survivorsSize, sizeof(typename S::Weight));
+	result->extra = result->size;
+	result->maintenanceRequests = 0;
+	result->updateWakeup = 0;
+	result->maintenanceSleeping = false;
+	result->updateSleeping = false;
+	result->done = false;
+	result->finished = true; // no round to wait for before the first restart
+	result->maintenanceThread = new std::thread(ALS_BackgroundMaintenance<S>, result);
+	return(result);
 }
-void ALS_Destroy(ALS_type * ALS)
+
+template<class S>
+void ALS_Destroy(S * ALS)
 {
 	std::cerr << "Destroy A" << std::endl;
+	if (ALS->background) {
+		// stop the maintenance thread before freeing the memory it works on
+		ALS->done = true;
+		HO_Notify(ALS->maintenanceRequests, ALS->maintenanceSleeping);
+		ALS->maintenanceThread->join();
+		delete ALS->maintenanceThread;
+		free(ALS->survivorCounters);
+		free(ALS->nextSurvivorCounters);
+		free(ALS->survivorHashtable);
+		free(ALS->nextSurvivorHashtable);
+	}
 	free(ALS->activeHashtable);
 	free(ALS->activeCounters);
+	free(ALS->passiveHashtable);
+	free(ALS->passiveCounters);
 	free(ALS->buffer);
-	ALS_DestroyPassive(ALS);
+	free(ALS->scratch);
 	free(ALS);
 }
 
-void ALS_RebuildHash(ALS_type * ALS)
+template<class S>
+static inline int ALS_Bucket(S * ALS, ALSitem_t item) {
+	return (int)(hash31(ALS->hasha, ALS->hashb, item) % ALS->hashsize);
+}
+
+/*
+The counter after c in its chain, or NULL. counters is the array of c.
+*/
+template<class Counter>
+static inline Counter * ALS_Next(Counter * counters, Counter * c) {
+#ifdef ALS_COMPACT_COUNTERS
+	return c->next ? &counters[c->next - 1] : NULL;
+#else
+	(void)counters; // only compact links are indices into it
+	return c->next;
+#endif
+}
+
+/*
+Link counters[index] in at the head of chain hashval in table.
+*/
+template<class Counter>
+static void ALS_Link(ALSBucket * table, Counter * counters, unsigned int epoch,
+	int index, int hashval) {
+	Counter * counter = &counters[index];
+	ALSBucket * bucket = &table[hashval];
+	Counter * hashptr = ALS_ChainHead(bucket, counters, epoch);
+	// The current head of the list becomes the second item in the list.
+#ifdef ALS_COMPACT_COUNTERS
+	counter->next = hashptr ? (int)(hashptr - counters) + 1 : 0;
+#else
+	counter->hash = hashval;
+	counter->next = hashptr;
+	if (hashptr)
+		hashptr->prev = counter;
+	counter->prev = NULL;
+#endif
+	bucket->head = index;
+	bucket->epoch = epoch;
+}
+
+template<class S>
+void ALS_RebuildHash(S * ALS)
 {
-	// rebuild the hash table and linked list pointers based on current
-	// contents of the counters array
+	// rebuild the hash tables and linked list pointers based on current
+	// contents of the counter arrays
 	int i;
-	ALSCounter * pt;
 
-	for (i = 0; i<ALS->hashsize; i++)
-		ALS->activeHashtable[i] = 0;
-		ALS->passiveHashtable[i] = 0;
-	// first, reset the hash table
-	for (i = 0; i < ALS->size; i++) {
-		ALS->activeCounters[i].next = NULL;
-		ALS->activeCounters[i].prev = NULL;
-		ALS->passiveCounters[i].next = NULL;
-		ALS->passiveCounters[i].prev = NULL;
-	}
-	// empty out the linked list
-	for (i = 0; i < ALS->size; i++) { // for each item in the data structure
-		pt = &ALS->activeCounters[i];
-		pt->next = ALS->activeHashtable[ALS->activeCounters[i].hash];
-		if (pt->next)
-			pt->next->prev = pt;
-		ALS->activeHashtable[ALS->activeCounters[i].hash] = pt;
-		pt = &ALS->passiveCounters[i];
-		pt->next = ALS->passiveHashtable[ALS->passiveCounters[i].hash];
-		if (pt->next)
-			pt->next->prev = pt;
-		ALS->passiveHashtable[ALS->passiveCounters[i].hash] = pt;
-	}
+	// first, reset the hash tables
+	memset(ALS->activeHashtable, 0, ALS->hashsize * sizeof(ALSBucket));
+	memset(ALS->passiveHashtable, 0, ALS->hashsize * sizeof(ALSBucket));
+	for (i = 0; i < ALS->nActive; i++)
+		ALS_Link(ALS->activeHashtable, ALS->activeCounters, ALS->activeEpoch, i,
+			ALS_Bucket(ALS, ALS->activeCounters[i].item));
+	for (i = 0; i < ALS->nPassive; i++)
+		ALS_Link(ALS->passiveHashtable, ALS->passiveCounters, ALS->passiveEpoch, i,
+			ALS_Bucket(ALS, ALS->passiveCounters[i].item));
 }
 
 
-ALSCounter * ALS_FindItemInActive(ALS_type * ALS, ALSitem_t item)
-{ // find a particular item in the date structure and return a pointer to it
-	ALSCounter * hashptr;
-	int hashval;
-	
-	hashval = (int)hash31(ALS->hasha, ALS->hashb, item) % ALS->hashsize;
-	if (hashval == 15) {
-		//ALS_CheckHash(ALS,0,0);
-	}
-	
-	hashptr = ALS->activeHashtable[hashval];
+template<class S>
+typename S::Counter * ALS_FindItemInActive(S * ALS, ALSitem_t item, int hashval)
+{ // find a particular item with the given hash and return a pointer to it
+	typename S::Counter * hashptr;
+
+	hashptr = ALS_ChainHead(&ALS->activeHashtable[hashval], ALS->activeCounters,
+		ALS->activeEpoch);
 	// compute the hash value of the item, and begin to look for it in 
 	// the hash table
 
 	while (hashptr) {
 		if (hashptr->item == item)
 			break;
-		else hashptr = hashptr->next;
+		else hashptr = ALS_Next(ALS->activeCounters, hashptr);
 	}
 	
 	return hashptr;
 	// returns NULL if we do not find the item
 }
 
-ALSCounter * ALS_FindItemInPassive(ALS_type * ALS, ALSitem_t item)
+template<class S>
+typename S::Counter * ALS_FindItemInActive(S * ALS, ALSitem_t item)
 { // find a particular item in the date structure and return a pointer to it
-	ALSCounter * hashptr;
-	int hashval;
+	return ALS_FindItemInActive(ALS, item, ALS_Bucket(ALS, item));
+}
 
-	hashval = (int)(hash31(ALS->hasha, ALS->hashb, item) % (ALS->hashsize));
-	hashptr = ALS->passiveHashtable[hashval];
+template<class S>
+typename S::Counter * ALS_FindItemInPassive(S * ALS, ALSitem_t item, int hashval)
+{ // find a particular item with the given hash and return a pointer to it
+	typename S::Counter * hashptr;
+
+	hashptr = ALS_ChainHead(&ALS->passiveHashtable[hashval], ALS->passiveCounters,
+		ALS->passiveEpoch);
 	// compute the hash value of the item, and begin to look for it in 
 	// the hash table
 
 	while (hashptr) {
 		if (hashptr->item == item)
 			break;
-		else hashptr = hashptr->next;
+		else hashptr = ALS_Next(ALS->passiveCounters, hashptr);
+	}
+
+	return hashptr;
+	// returns NULL if we do not find the item
+}
+
+template<class S>
+typename S::Counter * ALS_FindItemInPassive(S * ALS, ALSitem_t item)
+{ // find a particular item in the date structure and return a pointer to it
+	return ALS_FindItemInPassive(ALS, item, ALS_Bucket(ALS, item));
+}
+
+template<class S>
+typename S::Counter * ALS_FindItemInSurvivors(S * ALS, ALSitem_t item)
+{ // find an item among the survivors of the last maintenance round
+	typename S::Counter * hashptr;
+	int hashval;
+
+	if (ALS->nSurvivors == 0)
+		return NULL; // always so without ALS_InitBackground
+	hashval = (int)(hash31(ALS->hasha, ALS->hashb, item) % ALS->survivorsHashsize);
+	hashptr = ALS_ChainHead(&ALS->survivorHashtable[hashval], ALS->survivorCounters,
+		ALS->survivorsEpoch);
+	while (hashptr) {
+		if (hashptr->item == item)
+			break;
+		else hashptr = ALS_Next(ALS->survivorCounters, hashptr);
 	}
 
 	return hashptr;
@@ -163,24 +313,24 @@ ALSCounter * ALS_FindItemInPassive(ALS_type * ALS, ALSitem_t item)
 }
 
 
-ALSCounter * ALS_FindItem(ALS_type * ALS, ALSitem_t item)
+template<class S>
+typename S::Counter * ALS_FindItem(S * ALS, ALSitem_t item)
 { // find a particular item in the data structure and return a pointer to it
-	ALSCounter * hashptr;
+	typename S::Counter * hashptr;
 	int hashval;
 	hashptr = ALS_FindItemInActive(ALS, item);
 	if (!hashptr) {
 		hashptr = ALS_FindItemInPassive(ALS, item);
 	}
+	if (!hashptr) {
+		hashptr = ALS_FindItemInSurvivors(ALS, item);
+	}
 	return hashptr;
 	// returns NULL if we do not find the item
 }
 
-void ALS_AddItem(ALS_type *ALS, ALSitem_t item, ALSweight_t value) {
-
-	int hashval = (int)hash31(ALS->hasha, ALS->hashb, item) % ALS->hashsize;
-	ALSCounter* hashptr = ALS->activeHashtable[hashval];
-	// so, overwrite smallest heap item and reheapify if necessary
-	// fix up linked list from hashtable
+template<class S>
+void ALS_AddItem(S *ALS, ALSitem_t item, typename S::Weight value, int hashval) {
 	if (ALS->nActive >= ALS->size) {
 		std::cerr << "Error! Not enough room in table."<<std::endl;
 		std::cerr << "Size:"<<ALS->size<< " Active: " << ALS->nActive << " Passive:" << ALS->nPassive 
@@ -188,98 +338,63 @@ void ALS_AddItem(ALS_type *ALS, ALSitem_t item, ALSweight_t value) {
 			<< std::endl;
 	}
 	assert(ALS->nActive < ALS->size);
-	ALSCounter* counter = &(ALS->activeCounters[(ALS->nActive)++]);
-	// slot new item into hashtable
-	// counter goes to the beginning of the list.
-	// The current head of the list becomes the second item in the list.
-	counter->next = hashptr;
-	// If the list was not empty, 
-	if (hashptr)
-		// point the second item's previous item to the new counter.
-		hashptr->prev = counter;
-	// Now put the counter as the new head of the list.
-	ALS->activeHashtable[hashval] = counter;
-	// The head of the list has no previous item
-	counter->prev = NULL;
+	int index = (ALS->nActive)++;
+	typename S::Counter* counter = &(ALS->activeCounters[index]);
 	// save the current item
 	counter->item = item;
-	// save the current hash
-	counter->hash = hashval; 
 	// update the upper bound on the items frequency
 	counter->count = value; 	
+	// slot new item into hashtable, at the beginning of its list
+	ALS_Link(ALS->activeHashtable, ALS->activeCounters, ALS->activeEpoch, index,
+		hashval);
 }
 
+template<class S>
+void ALS_AddItem(S *ALS, ALSitem_t item, typename S::Weight value) {
+	ALS_AddItem(ALS, item, value, ALS_Bucket(ALS, item));
+}
 
 
 
-int ALS_in_place_find_kth(int *v, int n, int k, int jump, int pivot) {
-	assert(k < n);
-	if ((n == 1) && (k == 0)) return v[0];
-	else if (n == 2) {
-		return (v[k*jump] < v[(1 - k)*jump]) ? v[k*jump] : v[(1 - k)*jump];
-	}
-	if (pivot == 0) {
-		int m = (n + 4) / 5; // number of medians
-								//allocate space for medians.
-		for (int i = 0; i < m; i++) {
-			// if quintet is full
-			int to_sort = (n - 5 * i < 3)? (n - 5 * i): 3;
-			int quintet_size = (n - 5 * i < 5) ? (n - 5 * i) : 5;
-			int *w = &v[5 * i * jump];
-			// find 3 smallest items
-			for (int j0 = 0; j0 < to_sort; j0++) {
-				int jmin = j0;
-				for (int j = j0 + 1; j < quintet_size; j++) {
-					if (w[j*jump] < w[jmin*jump]) jmin = j;
-				}
-				swap(w[j0*jump], w[jmin*jump]);
-			}
-		
-		}
-		pivot = ALS_in_place_find_kth(v + 2*jump, (n+2)/5, (n + 2) / 5 / 2, jump * 5);
-	}
-	// put smaller items in the beginning
-	int store = 0;
-	for (int i = 0; i < n; i++) {
-		if (v[i*jump] < pivot) {
-			swap(v[i*jump], v[store*jump]);
-			store++;
-		}
-	}
-	// put pivots next
-	int store2 = store;
-	for (int i = store; i < n; i++) {
-		if (v[i*jump] == pivot) {
-			swap(v[i*jump], v[store2*jump]);
-			store2++;
-		}
-	}
-	// Then put the pivot
-	// if k is small, search for it in the beginning.
-	if (store > k) {
-		return ALS_in_place_find_kth(v, store, k, jump);
-	}
-	// if k is large, search for it at the end.
-	else if (k >= store2){
-		return ALS_in_place_find_kth(v + store2*jump, n - store2,
-			k - store2, jump);
-	}
-	else {
-		return pivot;
-	}
+
+/*
+With decay, moves the landmark up to the last update once that update
+added more than 2^ALS_DECAY_BITS times its weight. The move is a whole
+number of halvings, so the counts rescale exactly. Called at a restart,
+and maintenance rescales every counter it moves to the empty active table
+by passiveScale, or by ALS_RenormalizeInPlace.
+*/
+template<class S>
+static double ALS_Renormalize(S * ALS) {
+	if (ALS->lambda == 0)
+		return 1;
+	double halvings = floor(ALS->lambda * (ALS->lastTime - ALS->landmark) / log(2.0));
+	if (halvings < ALS_DECAY_BITS)
+		return 1;
+	ALS->landmark += halvings * log(2.0) / ALS->lambda;
+	double scale = ldexp(1.0, -(int)std::min(halvings, 4096.0));
+	ALS->quantile = (typename S::Weight)(ALS->quantile * scale);
+	ALS->n = (typename S::Weight)(ALS->n * scale);
+	return scale;
 }
 
-DWORD WINAPI ALS_Maintenance(LPVOID lpParam) {
+template<class Weight>
+static inline Weight ALS_Scaled(Weight count, double scale) {
+	return (scale == 1) ? count : (Weight)(count * scale);
+}
+
+template<class S>
+static void ALS_Maintenance(S* ALS) {
 	// FINISH MAINTENANCE	
 	// dnd quantile
-	ALS_type* ALS = (ALS_type*) lpParam;
+	double scale = ALS->passiveScale;
 	int k = ALS->nPassive - ceil(1 / ALS->epsilon)+1;
 	if (k >= 0) {
 		for (int i = 0; i < ALS->nPassive; ++i) {
-			ALS->buffer[i] = ALS->passiveCounters[i].count;
+			ALS->buffer[i] = ALS_Scaled(ALS->passiveCounters[i].count, scale);
 		}
-		int median = ALS_in_place_find_kth(ALS->buffer, ALS->nPassive, k, 1, ALS->quantile+1);
-		int test = 0;
+		QS_NoStep step;
+		typename S::Weight median = QS_FindKth(ALS->buffer, ALS->scratch, ALS->nPassive, k, ALS->quantile+1, step);
 		if (median > ALS->quantile) {
 			ALS->quantile = median;
 		}
@@ -287,12 +402,12 @@ DWORD WINAPI ALS_Maintenance(LPVOID lpParam) {
 	// Copy passive to active
 	ALS->movedFromPassive = 0;
 	for (int i = 0; i < ALS->nPassive; i++) {
-		if (ALS->passiveCounters[i].count > ALS->quantile) {
-			ALSCounter* c = ALS_FindItemInActive(ALS, ALS->passiveCounters[i].item);
+		typename S::Weight count = ALS_Scaled(ALS->passiveCounters[i].count, scale);
+		if (count > ALS->quantile) {
+			typename S::Counter* c = ALS_FindItemInActive(ALS, ALS->passiveCounters[i].item);
 			if (!c) {
 				++(ALS->movedFromPassive);
-				ALS_AddItem(ALS, ALS->passiveCounters[i].item,
-					ALS->passiveCounters[i].count);
+				ALS_AddItem(ALS, ALS->passiveCounters[i].item, count);
 			}
 			else {
 				// counter was already moved. We earned an extra addition.
@@ -300,44 +415,153 @@ DWORD WINAPI ALS_Maintenance(LPVOID lpParam) {
 			}
 		}
 	}
-	ALS_DestroyPassive(ALS);
-	ALS_InitPassive(ALS);
+	ALS_ClearPassive(ALS);
 	ALS->extra += ALS->maxMaintenanceTime;
-	return 0;
 }
 
-void ALS_RestartMaintenance(ALS_type* ALS) {
+/*
+A maintenance round of ALS_InitBackground, on its own thread. The passive
+counters and the survivors of the last round do not change until the
+update thread installs this round's result.
+*/
+template<class S>
+void ALS_BackgroundMaintenance(S* ALS) {
+	int handled = 0;
+	while (true) {
+		HO_WaitForChange(ALS->maintenanceRequests, handled, ALS->maintenanceSleeping);
+		++handled;
+		if (ALS->done)
+			return;
+		// an item that is in both only counts in the passive table
+		int m = 0;
+		for (int i = 0; i < ALS->nPassive; ++i)
+			ALS->buffer[m++] = ALS->passiveCounters[i].count;
+		for (int i = 0; i < ALS->nSurvivors; ++i) {
+			if (!ALS_FindItemInPassive(ALS, ALS->survivorCounters[i].item))
+				ALS->buffer[m++] = ALS->survivorCounters[i].count;
+		}
+		typename S::Weight quantile = ALS->quantile;
+		int k = m - ceil(1 / ALS->epsilon) + 1;
+		if (k >= 0 && k < m) {
+			QS_NoStep step;
+			typename S::Weight median = QS_FindKth(ALS->buffer, ALS->scratch, m, k, quantile + 1, step);
+			if (median > quantile)
+				quantile = median;
+		}
+		// keep the counters above the quantile, at most ceil(1/epsilon) - 1
+		ALS->nextSurvivorsEpoch = ALS_NewEpoch(ALS, ALS->nextSurvivorHashtable,
+			ALS->survivorsHashsize);
+		int n = 0;
+		for (int i = 0; i < ALS->nPassive + ALS->nSurvivors; ++i) {
+			typename S::Counter * c = (i < ALS->nPassive) ? &ALS->passiveCounters[i]
+				: &ALS->survivorCounters[i - ALS->nPassive];
+			if (c->count <= quantile)
+				continue;
+			if ((i >= ALS->nPassive) && ALS_FindItemInPassive(ALS, c->item))
+				continue;
+			assert(n < ALS->survivorsSize);
+			typename S::Counter * survivor = &ALS->nextSurvivorCounters[n];
+			survivor->item = c->item;
+			survivor->count = c->count;
+			ALS_Link(ALS->nextSurvivorHashtable, ALS->nextSurvivorCounters,
+				ALS->nextSurvivorsEpoch, n++,
+				(int)(hash31(ALS->hasha, ALS->hashb, c->item) % ALS->survivorsHashsize));
+		}
+		ALS->nNextSurvivors = n;
+		ALS->nextQuantile = quantile;
+		ALS->finished = true;
+		// Release update if it is waiting
+		HO_Notify(ALS->updateWakeup, ALS->updateSleeping);
+	}
+}
+
+/*
+Restart of ALS_InitBackground. Waits for the round in progress, installs
+its result and hands the full active table to the next round.
+*/
+template<class S>
+void ALS_RestartBackground(S* ALS) {
+	while (true) {
+		int seq = ALS->updateWakeup;
+		if (ALS->finished)
+			break;
+		HO_WaitForChange(ALS->updateWakeup, seq, ALS->updateSleeping);
+	}
+	// the survivors of the round replace those of the round before
+	typename S::Counter* tmp = ALS->survivorCounters;
+	ALS->survivorCounters = ALS->nextSurvivorCounters;
+	ALS->nextSurvivorCounters = tmp;
+	ALSBucket* tmpTable = ALS->survivorHashtable;
+	ALS->survivorHashtable = ALS->nextSurvivorHashtable;
+	ALS->nextSurvivorHashtable = tmpTable;
+	ALS->survivorsEpoch = ALS->nextSurvivorsEpoch;
+	ALS->nSurvivors = ALS->nNextSurvivors;
+	ALS->quantile = ALS->nextQuantile;
+	// switch counter arrays, and empty the new active one
+	tmp = ALS->activeCounters;
+	ALS->activeCounters = ALS->passiveCounters;
+	ALS->passiveCounters = tmp;
+	tmpTable = ALS->activeHashtable;
+	ALS->activeHashtable = ALS->passiveHashtable;
+	ALS->passiveHashtable = tmpTable;
+	ALS->passiveEpoch = ALS->activeEpoch;
+	ALS->activeEpoch = ALS_NewEpoch(ALS, ALS->activeHashtable, ALS->hashsize);
+	ALS->nPassive = ALS->nActive;
+	ALS->nActive = 0;
+	ALS->extra = ALS->size;
+	ALS->finished = false;
+	HO_Notify(ALS->maintenanceRequests, ALS->maintenanceSleeping);
+}
+
+/*
+Returns the factor that takes counts from before the restart to the units
+after it, which is 1 unless decay renormalized.
+*/
+template<class S>
+double ALS_RestartMaintenance(S* ALS) {
+	if (ALS->background) {
+		ALS_RestartBackground(ALS);
+		return 1;
+	}
 	// switch counter arrays
-	ALSCounter* tmp = ALS->activeCounters;
+	typename S::Counter* tmp = ALS->activeCounters;
 	ALS->activeCounters = ALS->passiveCounters;
 	ALS->passiveCounters = tmp;
 	int t = ALS->nActive;
 	ALS->nActive = ALS->nPassive;
 	ALS->nPassive = t;
 	// switch tables
-	ALSCounter** tmpTable = ALS->activeHashtable;
+	ALSBucket* tmpTable = ALS->activeHashtable;
 	ALS->activeHashtable = ALS->passiveHashtable;
 	ALS->passiveHashtable = tmpTable;
+	unsigned int tmpEpoch = ALS->activeEpoch;
+	ALS->activeEpoch = ALS->passiveEpoch;
+	ALS->passiveEpoch = tmpEpoch;
 	ALS->extra = ALS->size
 		- (ALS->nPassive < floor(1 / ALS->epsilon) ?
 			ALS->nPassive : floor(1 / ALS->epsilon))
 		- ALS->maxMaintenanceTime - ALS->nActive;
 	ALS->movedFromPassive = 0;
 	assert(ALS->extra >= 0);
+	ALS->passiveScale = ALS_Renormalize(ALS);
 	ALS_Maintenance(ALS);
+	return ALS->passiveScale;
 }
 
 
 
-void ALS_Update(ALS_type * ALS, ALSitem_t item, ALSweight_t value)
+/*
+ALS_Update with the item's hash already known.
+*/
+template<class S>
+static void ALS_UpdateAt(S * ALS, ALSitem_t item, typename S::Weight value, int hashval)
 {
-	int hashval;
-	ALSCounter * hashptr;
+	typename S::Counter * hashptr;
 	// find whether new item is already stored, if so store it and add one
 	// update heap property if necessary
 	ALS->n += value;
 	
-	hashptr = ALS_FindItemInActive(ALS, item);
+	hashptr = ALS_FindItemInActive(ALS, item, hashval);
 	if (hashptr) {
 		hashptr->count += value; // increment the count of the item
 		return;
@@ -345,7 +569,10 @@ void ALS_Update(ALS_type * ALS, ALSitem_t item, ALSweight_t value)
 	else {
 		// if control reaches here, then we have failed to find the item in the active table.
 		// so, search for it in the passive table
-		hashptr = ALS_FindItemInPassive(ALS, item);
+		hashptr = ALS_FindItemInPassive(ALS, item, hashval);
+		if (!hashptr) {
+			hashptr = ALS_FindItemInSurvivors(ALS, item);
+		}
 		if (hashptr) {
 			value += hashptr->count;
 		}
@@ -354,30 +581,120 @@ void ALS_Update(ALS_type * ALS, ALSitem_t item, ALSweight_t value)
 		}
 		//if (ALS->newItems == ALS->bucketSize) {
 		if (ALS->extra <= 0) {
-			// finish maintenance if started
-			//if (ALS->handle)
-			//	WaitForSingleObject(ALS->handle, INFINITE);
-			// start the maintenance thread anew.
-			ALS_RestartMaintenance(ALS);
+			// start maintenance anew.
+			value = ALS_Scaled(value, ALS_RestartMaintenance(ALS));
 		}
 		// Now add the item to the active hash table.
 		--(ALS->extra);
-		ALS_AddItem(ALS, item, value);
+		ALS_AddItem(ALS, item, value, hashval);
 		
 	}
 	//ALS_CheckHash(ALS, item, 0);
 }
 
-int ALS_Size(ALS_type * ALS)
+template<class S>
+void ALS_Update(S * ALS, ALSitem_t item, typename S::Weight value)
+{
+	ALS_UpdateAt(ALS, item, value, ALS_Bucket(ALS, item));
+}
+
+template<class S>
+static inline void ALS_PrefetchBuckets(S * ALS, int hashval) {
+	ALS_PREFETCH(&ALS->activeHashtable[hashval]);
+	ALS_PREFETCH(&ALS->passiveHashtable[hashval]);
+}
+
+template<class S>
+static inline void ALS_PrefetchHeads(S * ALS, int hashval) {
+	typename S::Counter * head = ALS_ChainHead(&ALS->activeHashtable[hashval],
+		ALS->activeCounters, ALS->activeEpoch);
+	if (head)
+		ALS_PREFETCH(head);
+	head = ALS_ChainHead(&ALS->passiveHashtable[hashval],
+		ALS->passiveCounters, ALS->passiveEpoch);
+	if (head)
+		ALS_PREFETCH(head);
+}
+
+/*
+Same as calling ALS_Update on each item in turn, but pipelined: an item is
+hashed and its buckets in both tables are prefetched ALS_PREFETCH_DISTANCE
+updates before it is applied, and the first counters of its chains half
+way there, once the buckets have arrived. The updates themselves are
+still applied in order. A maintenance restart in between only makes some
+prefetches useless, as the bucket of an item is the same in both tables.
+*/
+template<class S>
+void ALS_UpdateBatch(S * ALS, const ALSitem_t * items, const typename S::Weight * values, size_t n)
+{
+	int hashes[ALS_PREFETCH_DISTANCE]; // ring of the hashes of the items in flight
+	size_t ahead = std::min(n, (size_t)ALS_PREFETCH_DISTANCE);
+	for (size_t i = 0; i < ahead; ++i) {
+		hashes[i] = ALS_Bucket(ALS, items[i]);
+		ALS_PrefetchBuckets(ALS, hashes[i]);
+	}
+	for (size_t i = 0; i < n; ++i) {
+		int slot = i & (ALS_PREFETCH_DISTANCE - 1);
+		int hashval = hashes[slot];
+		if (i + ALS_PREFETCH_DISTANCE < n) {
+			hashes[slot] = ALS_Bucket(ALS, items[i + ALS_PREFETCH_DISTANCE]);
+			ALS_PrefetchBuckets(ALS, hashes[slot]);
+		}
+		if (i + ALS_PREFETCH_DISTANCE / 2 < n) {
+			ALS_PrefetchHeads(ALS,
+				hashes[(i + ALS_PREFETCH_DISTANCE / 2) & (ALS_PREFETCH_DISTANCE - 1)]);
+		}
+		ALS_UpdateAt(ALS, items[i], values[i], hashval);
+	}
+}
+
+template<class S>
+int ALS_Size(S * ALS)
 { // return the size of the data structure in bytes
-	return sizeof(ALS_type) + ALS->size*sizeof(int) // size of median buffer
-		+ 2*(ALS->hashsize * sizeof(ALSCounter*)) // two hash tables
-		+ 2*(ALS->size*sizeof(ALSCounter)); // two counter arrays
+	return sizeof(S) + 2*(ALS->size + ALS->survivorsSize)*sizeof(typename S::Weight) // size of median buffers
+		+ 2*(ALS->hashsize * sizeof(ALSBucket)) // two hash tables
+		+ 2*(ALS->size*sizeof(typename S::Counter)) // two counter arrays
+		+ 2*(ALS->survivorsHashsize * sizeof(ALSBucket)) // survivors, if any
+		+ 2*(ALS->survivorsSize*sizeof(typename S::Counter));
 }
 
-ALSweight_t ALS_PointEst(ALS_type * ALS, ALSitem_t item)
+/*
+The number of counters in the active and passive arrays and the survivors.
+*/
+template<class S>
+static int ALS_Counters(S * ALS) {
+	return ALS->nActive + ALS->nPassive + ALS->nSurvivors;
+}
+
+template<class S>
+static typename S::Counter * ALS_CounterAt(S * ALS, int i) {
+	// the i-th of the ALS_Counters(ALS) counters
+	if (i < ALS->nActive)
+		return &ALS->activeCounters[i];
+	i -= ALS->nActive;
+	if (i < ALS->nPassive)
+		return &ALS->passiveCounters[i];
+	return &ALS->survivorCounters[i - ALS->nPassive];
+}
+
+/*
+Whether c, the i-th counter, is hidden by an earlier counter of its item:
+the active count of an item includes its passive count, and the passive
+one is newer than a survivor.
+*/
+template<class S>
+static bool ALS_Shadowed(S * ALS, int i, typename S::Counter * c) {
+	if (i < ALS->nActive)
+		return false;
+	if (ALS_FindItemInActive(ALS, c->item))
+		return true;
+	return i >= ALS->nActive + ALS->nPassive && ALS_FindItemInPassive(ALS, c->item);
+}
+
+template<class S>
+typename S::Weight ALS_PointEst(S * ALS, ALSitem_t item)
 { // estimate the count of a particular item
-	ALSCounter * i;
+	typename S::Counter * i;
 	i = ALS_FindItem(ALS, item);
 	if (i)
 		return(i->count);
@@ -385,7 +702,8 @@ ALSweight_t ALS_PointEst(ALS_type * ALS, ALSitem_t item)
 		return ALS->quantile;
 }
 
-ALSweight_t ALS_PointErr(ALS_type * ALS, ALSitem_t item)
+template<class S>
+typename S::Weight ALS_PointErr(S * ALS, ALSitem_t item)
 { // estimate the worst case error in the estimate of a particular item
 	return ALS->quantile;
 }
@@ -398,44 +716,254 @@ int ALS_cmp(const void * a, const void * b) {
 	else return 0;
 }
 
-void ALS_Output(ALS_type * ALS) { // prepare for output
+template<class S>
+void ALS_Output(S * ALS) { // prepare for output
+}
+
+template<class S>
+std::map<ALSitem_t, typename S::Report> ALS_Output(S * ALS, uint64_t thresh)
+{
+	std::map<ALSitem_t, typename S::Report> res;
+	typename S::Sink sink = TK_Visitor(TK_Insert<ALSitem_t, typename S::Report>, &res);
+	ALS_OutputTo(ALS, thresh, &sink);
+	return res;
+}
+
+/*
+Reports every item whose count is at least thresh to sink, times unscale,
+and returns how many there are. Counters are only looked up in the newer
+tables once they pass the threshold.
+*/
+template<class S>
+static int ALS_ReportAtLeast(S * ALS, typename S::Weight thresh, double unscale, typename S::Sink * sink)
+{
+	for (int i = 0; i < ALS_Counters(ALS); ++i) {
+		typename S::Counter * c = ALS_CounterAt(ALS, i);
+		if (c->count >= thresh && !ALS_Shadowed(ALS, i, c))
+			TK_Report(sink, c->item, ALS_Scaled(c->count, unscale));
+	}
+	return sink->n;
+}
+
+template<class S>
+int ALS_OutputTo(S * ALS, uint64_t thresh, typename S::Sink * sink)
+{
+	return ALS_ReportAtLeast(ALS, (typename S::Weight)thresh, 1, sink);
 }
 
-std::map<uint32_t, uint32_t> ALS_Output(ALS_type * ALS, uint64_t thresh)
+/*
+Writes the k items with the largest counts to out, largest first, and
+returns how many there are. The active counters go first, so the others
+are only looked up if they beat the k-th largest active count.
+*/
+template<class S>
+int ALS_TopK(S * ALS, int k, typename S::Pair * out)
 {
-	std::map<uint32_t, uint32_t> res;
+	int n = 0;
+	if (k <= 0)
+		return 0;
+	for (int i = 0; i < ALS_Counters(ALS); ++i) {
+		typename S::Counter * c = ALS_CounterAt(ALS, i);
+		if (TK_Admits(out, n, k, c->count) && !ALS_Shadowed(ALS, i, c))
+			TK_Offer(out, n, k, c->item, c->count);
+	}
+	TK_SortTop(out, n);
+	return n;
+}
 
+template<class S>
+void ALS_SetDecay(S * ALS, double lambda, double now)
+{ // to be called on an empty summary
+	static_assert(std::is_floating_point<typename S::Weight>::value, "decay needs floating point weights");
+	assert(!ALS->background);
+	ALS->lambda = lambda;
+	ALS->landmark = now;
+	ALS->lastTime = now;
+}
+
+template<class S>
+double ALS_DecayScale(S * ALS, double t)
+{ // what an update of weight 1 at time t adds
+	return exp(ALS->lambda * (t - ALS->landmark));
+}
+
+/*
+Renormalizes without a restart, for a stream whose items all fit in the
+summary, which never restarts. Done once the counts grew past twice the
+bits a restart waits for, so restarts do it whenever they come. The
+passive table is empty between updates, so the active counters are all
+there is to scale.
+*/
+template<class S>
+static void ALS_RenormalizeInPlace(S * ALS)
+{
+	if (ALS->lambda * (ALS->lastTime - ALS->landmark) < 2 * ALS_DECAY_BITS * log(2.0))
+		return;
+	double scale = ALS_Renormalize(ALS);
 	for (int i = 0; i < ALS->nActive; ++i)
-	{
-		if (ALS->activeCounters[i].count >= thresh)
-			res.insert(std::pair<uint32_t, uint32_t>(ALS->activeCounters[i].item, ALS->activeCounters[i].count));
+		ALS->activeCounters[i].count = ALS_Scaled(ALS->activeCounters[i].count, scale);
+}
+
+template<class S>
+void ALS_UpdateDecayed(S * ALS, ALSitem_t item, typename S::Weight value, double t)
+{
+	static_assert(std::is_floating_point<typename S::Weight>::value, "decay needs floating point weights");
+	if (t > ALS->lastTime)
+		ALS->lastTime = t;
+	ALS_RenormalizeInPlace(ALS);
+	ALS_Update(ALS, item, (typename S::Weight)(value * ALS_DecayScale(ALS, t)));
+}
+
+template<class S>
+typename S::Weight ALS_DecayedPointEst(S * ALS, ALSitem_t item, double t)
+{ // estimate the decayed count of a particular item at time t
+	return (typename S::Weight)(ALS_PointEst(ALS, item) / ALS_DecayScale(ALS, t));
+}
+
+/*
+ALS_OutputTo for a threshold on the decayed counts at time t, which are
+the counts that are reported.
+*/
+template<class S>
+int ALS_DecayedOutputTo(S * ALS, double thresh, double t, typename S::Sink * sink)
+{
+	double scale = ALS_DecayScale(ALS, t);
+	return ALS_ReportAtLeast(ALS, (typename S::Weight)(thresh * scale), 1 / scale, sink);
+}
+
+/*
+Adds every item of a to merged, with its estimate in a plus its estimate
+in b. Items of a that are in b are skipped if skipShared is set.
+Returns the new number of entries in merged.
+*/
+template<class S>
+static int ALS_MergeInto(typename S::Counter * merged, int m, S * a, S * b,
+	bool skipShared)
+{
+	for (int i = 0; i < ALS_Counters(a); ++i) {
+		typename S::Counter * c = ALS_CounterAt(a, i);
+		if (ALS_Shadowed(a, i, c))
+			continue;
+		typename S::Counter * other = ALS_FindItem(b, c->item);
+		if (other && skipShared)
+			continue;
+		merged[m].item = c->item;
+		merged[m].count = c->count + (other ? other->count : b->quantile);
+		++m;
+	}
+	return m;
+}
+
+/*
+Returns a new summary of the two streams that a and b summarize, which
+must come from ALS_Init with the same parameters. Every item gets the sum
+of its estimates in a and b, then the sums are pruned to the
+ceil(1/epsilon) largest by raising the quantile, as in ALS_Maintenance.
+The error stays within epsilon times the combined weight. The result
+runs its maintenance on a thread if a does.
+*/
+template<class S>
+S * ALS_Merge(S * a, S * b)
+{
+	assert(a->epsilon == b->epsilon && a->gamma == b->gamma);
+	// decayed counts only add up in the same units
+	assert(a->lambda == b->lambda && a->landmark == b->landmark);
+	int capacity = ALS_Counters(a) + ALS_Counters(b) + 1;
+	typename S::Counter * merged = (typename S::Counter *)calloc(capacity, sizeof(typename S::Counter));
+	typename S::Weight * counts = (typename S::Weight *)calloc(2 * capacity, sizeof(typename S::Weight)); // and selection scratch
+	int m = ALS_MergeInto(merged, 0, a, b, false);
+	m = ALS_MergeInto(merged, m, b, a, true);
+	typename S::Weight quantile = a->quantile + b->quantile;
+	int k = m - ceil(1 / a->epsilon) + 1;
+	if (k >= 0 && k < m) {
+		for (int i = 0; i < m; ++i)
+			counts[i] = merged[i].count;
+		QS_NoStep step;
+		typename S::Weight median = QS_FindKth(counts, counts + m, m, k, quantile + 1, step);
+		if (median > quantile)
+			quantile = median;
 	}
-	for (int i = 0; i < ALS->nPassive; ++i) {
-		if (ALS_FindItemInActive(ALS, ALS->passiveCounters[i].item) == NULL) {
-			if (ALS->passiveCounters[i].count >= thresh) {
-				res.insert(std::pair<uint32_t, uint32_t>(ALS->passiveCounters[i].item, ALS->passiveCounters[i].count));
+	S * result = a->background ? ALS_InitBackground<S>(a->epsilon, a->gamma)
+		: ALS_Init<S>(a->epsilon, a->gamma);
+	for (int i = 0; i < m; ++i) {
+		if (merged[i].count > quantile)
+			ALS_AddItem(result, merged[i].item, merged[i].count);
+	}
+	result->quantile = quantile;
+	// the first restart of a background result installs nextQuantile
+	result->nextQuantile = quantile;
+	result->n = a->n + b->n;
+	result->lambda = a->lambda;
+	result->landmark = a->landmark;
+	result->lastTime = std::max(a->lastTime, b->lastTime);
+	// ALS_Init assumed an empty summary
+	result->extra = result->size - result->nActive;
+	free(merged);
+	free(counts);
+	return result;
+}
+
+/*
+Merges the n summaries pairwise, level by level, so that no summary goes
+through more than log2(n) merges. The inputs are left as they are, and
+the result is a new summary.
+*/
+template<class S>
+S * ALS_MergeAll(S ** summaries, int n)
+{
+	assert(n > 0);
+	S ** level = (S **)calloc(n, sizeof(S *));
+	int count = 0;
+	for (int i = 0; i < n; i += 2) {
+		if (i + 1 < n) {
+			level[count++] = ALS_Merge(summaries[i], summaries[i + 1]);
+		}
+		else {
+			// copy the odd one out, so that every summary in level is ours
+			S * empty = ALS_Init<S>(summaries[i]->epsilon, summaries[i]->gamma);
+			level[count++] = ALS_Merge(summaries[i], empty);
+			ALS_Destroy(empty);
+		}
+	}
+	while (count > 1) {
+		int next = 0;
+		for (int i = 0; i < count; i += 2) {
+			if (i + 1 < count) {
+				S * merged = ALS_Merge(level[i], level[i + 1]);
+				ALS_Destroy(level[i]);
+				ALS_Destroy(level[i + 1]);
+				level[next++] = merged;
+			}
+			else {
+				level[next++] = level[i];
 			}
 		}
+		count = next;
 	}
-	return res;
+	S * result = level[0];
+	free(level);
+	return result;
 }
 
-void ALS_CheckHash(ALS_type * ALS, int item, int hash)
+template<class S>
+void ALS_CheckHash(S * ALS, int item, int hash)
 { // debugging routine to validate the hash table
 	int i;
-	ALSCounter *hashptr, *prev;
+	typename S::Counter *hashptr, *prev;
 
 	for (i = 0; i<ALS->hashsize; i++)
 	{
 		prev = NULL;
-		hashptr = ALS->activeHashtable[i];
+		hashptr = ALS_ChainHead(&ALS->activeHashtable[i], ALS->activeCounters,
+			ALS->activeEpoch);
 		while (hashptr) {
-			if (hashptr->hash != i)
+			if (ALS_Bucket(ALS, hashptr->item) != i)
 			{
 				printf("\n Hash violation! hash = %d, should be %d \n",
-					hashptr->hash, i);
+					ALS_Bucket(ALS, hashptr->item), i);
 				printf("after inserting item %d with hash %d\n", item, hash);
 			}
+#ifndef ALS_COMPACT_COUNTERS
 			if (hashptr->prev != prev)
 			{
 				printf("\n Previous violation! prev = %d, should be %d\n",
@@ -443,34 +971,44 @@ void ALS_CheckHash(ALS_type * ALS, int item, int hash)
 				printf("after inserting item %d with hash %d\n", item, hash);
 				exit(EXIT_FAILURE);
 			}
+#endif
 			prev = hashptr;
-			hashptr = hashptr->next;
+			hashptr = ALS_Next(ALS->activeCounters, hashptr);
 		}
 	}
 }
 
-void ALS_ShowHash(ALS_type * ALS)
+template<class S>
+void ALS_ShowHash(S * ALS)
 { // debugging routine to show the hashtable
 	int i;
-	ALSCounter * hashptr;
+	typename S::Counter * hashptr;
 
 	for (i = 0; i<ALS->hashsize; i++)
 	{
 		printf("%d:", i);
-		hashptr = ALS->activeHashtable[i];
+		hashptr = ALS_ChainHead(&ALS->activeHashtable[i], ALS->activeCounters,
+			ALS->activeEpoch);
 		while (hashptr) {
+#ifdef ALS_COMPACT_COUNTERS
+			printf(" %d [h(%u) = %d] ---> ", (int)(hashptr - ALS->activeCounters),
+				(unsigned int)hashptr->item,
+				ALS_Bucket(ALS, hashptr->item));
+#else
 			printf(" %d [h(%u) = %d, prev = %d] ---> ", (int)hashptr,
 				(unsigned int)hashptr->item,
 				hashptr->hash,
 				(int)hashptr->prev);
-			hashptr = hashptr->next;
+#endif
+			hashptr = ALS_Next(ALS->activeCounters, hashptr);
 		}
 		printf(" *** \n");
 	}
 }
 
 
-void ALS_ShowHeap(ALS_type * ALS)
+template<class S>
+void ALS_ShowHeap(S * ALS)
 { // debugging routine to show the heap
 	int i, j;
 
@@ -486,3 +1024,31 @@ void ALS_ShowHeap(ALS_type * ALS)
 	}
 	printf("\n\n");
 }
+
+#define ALS_INSTANTIATE(S) \
+	template S * ALS_Init<S>(float, float); \
+	template S * ALS_InitBackground<S>(float, float); \
+	template void ALS_Destroy<S>(S *); \
+	template void ALS_Update<S>(S *, ALSitem_t, S::Weight); \
+	template void ALS_UpdateBatch<S>(S *, const ALSitem_t *, const S::Weight *, size_t); \
+	template int ALS_Size<S>(S *); \
+	template S::Weight ALS_PointEst<S>(S *, ALSitem_t); \
+	template S::Weight ALS_PointErr<S>(S *, ALSitem_t); \
+	template void ALS_CheckHash<S>(S *, int, int); \
+	template std::map<ALSitem_t, S::Report> ALS_Output<S>(S *, uint64_t); \
+	template int ALS_OutputTo<S>(S *, uint64_t, S::Sink *); \
+	template int ALS_TopK<S>(S *, int, S::Pair *); \
+	template S * ALS_Merge<S>(S *, S *); \
+	template S * ALS_MergeAll<S>(S **, int);
+
+// only for floating point weights
+#define ALS_INSTANTIATE_DECAY(S) \
+	template void ALS_SetDecay<S>(S *, double, double); \
+	template double ALS_DecayScale<S>(S *, double); \
+	template void ALS_UpdateDecayed<S>(S *, ALSitem_t, S::Weight, double); \
+	template S::Weight ALS_DecayedPointEst<S>(S *, ALSitem_t, double); \
+	template int ALS_DecayedOutputTo<S>(S *, double, double, S::Sink *);
+
+ALS_INSTANTIATE(ALS_type)
+ALS_INSTANTIATE(ALSDecay_type)
+ALS_INSTANTIATE_DECAY(ALSDecay_type)
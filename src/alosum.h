@@ -1,6 +1,8 @@
 #pragma once
 #include "prng.h"
-#include <windows.h>
+#include "topk.h"
+#include <atomic>
+#include <thread>
 // losum.h -- header file for Lossy Summing
 
 /////////////////////////////////////////////////////////
@@ -11,45 +13,125 @@
 
 #define ALSitem_t uint32_t
 #define GAMMA 1.0
-typedef struct ALScounter_t ALSCounter;
 
+//#define ALS_COMPACT_COUNTERS // counters of item and count only, see below
+#ifdef ALS_COMPACT_COUNTERS
+// Chains link counters by index, the hash is computed again from the item
+// when it is needed, and there is no back link, as items are never removed
+// from a table.
+template<class Weight>
+struct ALScounter_t
+{
+	ALSitem_t item; // item identifier
+	Weight count; // (upper bound on) count for the item
+	int next; // index + 1 of the next counter in the chain, 0 ends it
+}; // 12 bytes for 32 bit weights
+#else
+template<class Weight>
 struct ALScounter_t
 {
 	ALSitem_t item; // item identifier
 	int hash; // its hash value
-	ALSweight_t count; // (upper bound on) count for the item
-	ALSCounter *prev, *next; // pointers in doubly linked list for hashtable
-};
+	Weight count; // (upper bound on) count for the item
+	ALScounter_t *prev, *next; // pointers in doubly linked list for hashtable
+}; // 32 bytes on 64 bit
+#endif
+
+typedef ALScounter_t<ALSweight_t> ALSCounter;
 
 #define ALS_HASHMULT 3  // how big to make the hashtable of elements:
 
+/*
+Head of a hash chain. Clearing a table only hands it a new epoch, and a
+bucket whose epoch is not its table's holds no counters, so maintenance
+clears the passive table without touching it.
+*/
+typedef struct ALSbucket_t
+{
+	unsigned int epoch; // the chain is empty unless this is the table's epoch
+	int head; // index of the first counter in the chain
+} ALSBucket;
+
 #ifdef ALS_SIZE
 #define ALS_SPACE (ALS_HASHMULT*ALS_SIZE)
 #endif
 
-typedef struct ALS_type
+/*
+An IMSum summary of Weight sums per item, which is reported to sinks as
+Report. The instances alosum.cc provides are the typedefs below.
+*/
+template<class WeightT, class ReportT = WeightT>
+struct ALSsummary_t
 {
-	ALSweight_t n;
+	typedef WeightT Weight;
+	typedef ReportT Report;
+	typedef ALScounter_t<Weight> Counter;
+	typedef TKpair_t<ALSitem_t, Report> Pair; // for ALS_OutputTo and ALS_TopK
+	typedef TKsink_t<ALSitem_t, Report> Sink;
+
+	Weight n;
 	int hasha, hashb, hashsize;
 	int size, maxMaintenanceTime;
 	int nActive, nPassive, extra, movedFromPassive;
-	int* buffer;
-	int quantile;
+	Weight* buffer; // counts copied for the quantile selection
+	Weight* scratch; // second buffer for the selection
+	Weight quantile;
+	unsigned int epoch; // the last epoch handed to a table
+	unsigned int activeEpoch, passiveEpoch;
+	int wrapClears; // clears that must wipe their table, after epoch wrapped
 	float epsilon;
 	float gamma;
-	HANDLE handle;
-	ALSCounter *activeCounters;
-	ALSCounter *passiveCounters;
-	ALSCounter ** activeHashtable; // array of pointers to items in 'counters'
-	ALSCounter ** passiveHashtable; // array of pointers to items in 'counters'
-} ALS_type;
-
-extern ALS_type * ALS_Init(float fPhi, float gamma = GAMMA);
-extern void ALS_Destroy(ALS_type *);
-extern void ALS_Update(ALS_type *, ALSitem_t, int);
-extern int ALS_Size(ALS_type *);
-extern int ALS_PointEst(ALS_type *, ALSitem_t);
-extern int ALS_PointErr(ALS_type *, ALSitem_t);
-extern void ALS_CheckHash(ALS_type * ALS, int item, int hash);
-extern std::map<uint32_t, uint32_t> ALS_Output(ALS_type *, uint64_t thresh);
-extern int ALS_in_place_find_kth(int *v, int n, int k, int jump=1, int pivot=0);
+	// Forward decay, see ALS_SetDecay. lambda is 0 without it.
+	double lambda, landmark, lastTime;
+	double passiveScale; // for the counters that maintenance moves
+	Counter *activeCounters;
+	Counter *passiveCounters;
+	ALSBucket * activeHashtable; // hash table of items in 'activeCounters'
+	ALSBucket * passiveHashtable; // hash table of items in 'passiveCounters'
+	// Only with ALS_InitBackground. The counters that survived the last
+	// maintenance round, and the ones the round in progress keeps.
+	bool background;
+	int survivorsSize, survivorsHashsize;
+	int nSurvivors, nNextSurvivors;
+	Weight nextQuantile; // the quantile the round in progress selected
+	unsigned int survivorsEpoch, nextSurvivorsEpoch;
+	Counter *survivorCounters, *nextSurvivorCounters;
+	ALSBucket *survivorHashtable, *nextSurvivorHashtable;
+	std::thread* maintenanceThread;
+	// Handoff words between the update thread and the maintenance thread,
+	// as in LSsummary_t.
+	std::atomic_int maintenanceRequests, updateWakeup;
+	std::atomic_bool maintenanceSleeping, updateSleeping;
+	std::atomic_bool done, finished;
+};
+
+typedef ALSsummary_t<ALSweight_t, uint32_t> ALS_type; // reports to a TKSink
+typedef ALSsummary_t<double> ALSDecay_type; // for ALS_SetDecay
+
+template<class S = ALS_type> S * ALS_Init(float fPhi, float gamma = GAMMA);
+template<class S = ALS_type> S * ALS_InitBackground(float fPhi, float gamma = GAMMA);
+template<class S> void ALS_Destroy(S *);
+template<class S> void ALS_Update(S *, ALSitem_t, typename S::Weight);
+template<class S> void ALS_UpdateBatch(S *, const ALSitem_t *, const typename S::Weight *, size_t);
+template<class S> int ALS_Size(S *);
+template<class S> typename S::Weight ALS_PointEst(S *, ALSitem_t);
+template<class S> typename S::Weight ALS_PointErr(S *, ALSitem_t);
+template<class S> void ALS_CheckHash(S * ALS, int item, int hash);
+template<class S> std::map<ALSitem_t, typename S::Report> ALS_Output(S *, uint64_t thresh);
+template<class S> int ALS_OutputTo(S *, uint64_t thresh, typename S::Sink *);
+template<class S> int ALS_TopK(S *, int k, typename S::Pair * out);
+template<class S> S * ALS_Merge(S *, S *);
+template<class S> S * ALS_MergeAll(S **, int);
+
+// Forward decay, as LS_SetDecay in losum.h: an update at time t adds its
+// weight times exp(lambda * (t - landmark)). The landmark moves up when a
+// maintenance round finds the counts grown past 2^ALS_DECAY_BITS times the
+// weights, and the round rescales the counters as it moves them. Without
+// restarts, an update rescales the counters in place once the counts grew
+// past 2^(2 ALS_DECAY_BITS). Only for ALSDecay_type summaries from ALS_Init.
+#define ALS_DECAY_BITS 64
+template<class S> void ALS_SetDecay(S *, double lambda, double now);
+template<class S> double ALS_DecayScale(S *, double t);
+template<class S> void ALS_UpdateDecayed(S *, ALSitem_t, typename S::Weight, double t);
+template<class S> typename S::Weight ALS_DecayedPointEst(S *, ALSitem_t, double t);
+template<class S> int ALS_DecayedOutputTo(S *, double thresh, double t, typename S::Sink *);
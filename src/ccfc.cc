@@ -132,7 +132,7 @@ int CCFC_Count(CCFC_type * ccfc, int depth, int item)
 	return(i);
 }
 
-void ccfc_recursive(CCFC_type * ccfc, int depth, int start, int thresh, std::map<uint32_t, uint32_t>& res)
+void ccfc_recursive(CCFC_type * ccfc, int depth, int start, int thresh, TKSink * sink)
 {
 	int i;
 	int blocksize;
@@ -145,7 +145,7 @@ void ccfc_recursive(CCFC_type * ccfc, int depth, int start, int thresh, std::map
 	{ 
 		if (depth==0)
 		{
-			if (res.size() < ccfc->buckets) res[start] = estcount;
+			if (sink->n < ccfc->buckets) TK_Report(sink, (uint32_t)start, estcount);
 		}
 		else
 		{
@@ -153,7 +153,7 @@ void ccfc_recursive(CCFC_type * ccfc, int depth, int start, int thresh, std::map
 			itemshift=start<<ccfc->gran;
 			// assumes that gran is an exact multiple of the bit dept
 			for (i=0;i<blocksize;i++)
-				ccfc_recursive(ccfc,depth-ccfc->gran,itemshift+i,thresh,res);
+				ccfc_recursive(ccfc,depth-ccfc->gran,itemshift+i,thresh,sink);
 		}
 	}
 }
@@ -161,10 +161,17 @@ void ccfc_recursive(CCFC_type * ccfc, int depth, int start, int thresh, std::map
 std::map<uint32_t, uint32_t> CCFC_Output(CCFC_type * ccfc, int thresh)
 {
 	std::map<uint32_t, uint32_t> res;
-	ccfc_recursive(ccfc,ccfc->logn,0,thresh,res);
+	TKSink sink = TK_Visitor(TK_Insert<uint32_t, uint32_t>, &res);
+	ccfc_recursive(ccfc,ccfc->logn,0,thresh,&sink);
 	return res;
 }
 
+int CCFC_OutputTo(CCFC_type * ccfc, int thresh, TKSink * sink)
+{ // report the items whose estimated count is at least thresh to sink
+	ccfc_recursive(ccfc,ccfc->logn,0,thresh,sink);
+	return sink->n;
+}
+
 int64_t CCFC_F2Est(CCFC_type * ccfc)
 {
   int i,j, r;
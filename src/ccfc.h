@@ -5,6 +5,7 @@
 #define CCFC_h
 
 #include "prng.h"
+#include "topk.h"
 
 typedef struct CCFC_type{
   int tests;
@@ -20,6 +21,7 @@ extern CCFC_type * CCFC_Init(int, int, int, int);
 extern void CCFC_Update(CCFC_type *, int, int); 
 extern int CCFC_Count(CCFC_type *, int, int);
 extern std::map<uint32_t, uint32_t> CCFC_Output(CCFC_type *, int);
+extern int CCFC_OutputTo(CCFC_type *, int, TKSink *);
 extern int64_t CCFC_F2Est(CCFC_type *);
 extern void CCFC_Destroy(CCFC_type *);
 extern int CCFC_Size(CCFC_type *);
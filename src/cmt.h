@@ -0,0 +1,152 @@
+// cmt.h -- Count-Min sketch with its depth and width fixed at compile time.
+//
+// A drop-in for CM_type where the sizes are known ahead: CMT_type<Depth,
+// LogWidth> has Depth rows of 2^LogWidth counters. The rows hash with
+// multiply-add-shift, h(x) = (a x + b mod 2^64) >> (64 - LogWidth) for
+// random 64 bit a and b, which is pairwise independent for 32 bit items
+// and needs no modulo. With AVX2 four rows are hashed per instruction,
+// so all Depth hashes take one pass. The counters of all rows are in one
+// array, row j at j << LogWidth.
+
+#ifndef CMT_h
+#define CMT_h
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "prng.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+template<int Depth, int LogWidth>
+struct CMT_type
+{
+  static const int depth = Depth;
+  static const int width = 1 << LogWidth;
+  static const int lanes = (Depth + 3) & ~3; // rows hashed, in whole vectors
+  int64_t count;
+  uint64_t hasha[lanes], hashb[lanes]; // rows past depth are never read
+  int * counts; // depth rows of width
+};
+
+static inline uint64_t CMT_Random64(prng_type * prng)
+{ // prng_int gives about 30 random bits
+  uint64_t r = (uint64_t) prng_int(prng) << 34;
+  r ^= (uint64_t) prng_int(prng) << 17;
+  return r ^ (uint64_t) prng_int(prng);
+}
+
+template<int Depth, int LogWidth>
+CMT_type<Depth, LogWidth> * CMT_Init(int seed)
+{
+  typedef CMT_type<Depth, LogWidth> CM;
+  static_assert(Depth > 0 && LogWidth > 0 && LogWidth < 31, "CMT_type sizes");
+  static_assert((int64_t) Depth << LogWidth <= 0x7FFFFFFF, "CMT_type indices are int");
+  CM * cm;
+  prng_type * prng;
+  int j;
+
+  cm=(CM *) calloc(1, sizeof(CM));
+  prng=prng_Init(-abs(seed),2);
+  if (cm && prng)
+    {
+      cm->count=0;
+      cm->counts=(int *) calloc(sizeof(int), (size_t) Depth << LogWidth);
+      if (cm->counts)
+        {
+          for (j=0;j<Depth;j++)
+            {
+              cm->hasha[j]=CMT_Random64(prng);
+              cm->hashb[j]=CMT_Random64(prng);
+            }
+        }
+      else
+        {
+          free(cm);
+          cm=NULL;
+        }
+    }
+  else
+    {
+      free(cm);
+      cm=NULL;
+    }
+  if (prng) prng_Destroy(prng);
+  return cm;
+}
+
+template<int Depth, int LogWidth>
+void CMT_Destroy(CMT_type<Depth, LogWidth> * cm)
+{
+  if (!cm) return;
+  free(cm->counts);
+  free(cm);
+}
+
+template<int Depth, int LogWidth>
+int CMT_Size(CMT_type<Depth, LogWidth> * cm)
+{ // return the size of the sketch in bytes
+  if (!cm) return 0;
+  return (int) (sizeof(CMT_type<Depth, LogWidth>) + ((size_t) Depth << LogWidth) * sizeof(int));
+}
+
+/*
+Puts the index of the counter of item in every row into idx, which has
+room for lanes entries.
+*/
+template<int Depth, int LogWidth>
+inline void CMT_Hash(const CMT_type<Depth, LogWidth> * cm, unsigned int item, int * idx)
+{
+  typedef CMT_type<Depth, LogWidth> CM;
+#ifdef __AVX2__
+  const __m256i x = _mm256_set1_epi64x(item);
+  const __m256i step = _mm256_set1_epi64x((int64_t) 4 << LogWidth);
+  __m256i row = _mm256_setr_epi64x(0, (int64_t) 1 << LogWidth,
+    (int64_t) 2 << LogWidth, (int64_t) 3 << LogWidth);
+  for (int j=0;j<CM::lanes;j+=4)
+    {
+      __m256i a = _mm256_loadu_si256((const __m256i *) &cm->hasha[j]);
+      __m256i b = _mm256_loadu_si256((const __m256i *) &cm->hashb[j]);
+      // a x mod 2^64 from the two 32 bit halves of a
+      __m256i lo = _mm256_mul_epu32(a, x);
+      __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), x);
+      __m256i h = _mm256_add_epi64(_mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32)), b);
+      h = _mm256_add_epi64(_mm256_srli_epi64(h, 64 - LogWidth), row);
+      // the indices are below 2^31, so their low halves are enough
+      h = _mm256_permutevar8x32_epi32(h, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6));
+      _mm_storeu_si128((__m128i *) &idx[j], _mm256_castsi256_si128(h));
+      row = _mm256_add_epi64(row, step);
+    }
+#else
+  for (int j=0;j<Depth;j++)
+    idx[j]=(j << LogWidth) + (int) ((cm->hasha[j] * item + cm->hashb[j]) >> (64 - LogWidth));
+#endif
+}
+
+template<int Depth, int LogWidth>
+inline void CMT_Update(CMT_type<Depth, LogWidth> * cm, unsigned int item, int diff)
+{
+  int idx[CMT_type<Depth, LogWidth>::lanes];
+  int j;
+
+  cm->count+=diff;
+  CMT_Hash(cm, item, idx);
+  for (j=0;j<Depth;j++)
+    cm->counts[idx[j]]+=diff;
+}
+
+template<int Depth, int LogWidth>
+inline int CMT_PointEst(const CMT_type<Depth, LogWidth> * cm, unsigned int query)
+{
+  // return an estimate of the count of an item by taking the minimum
+  int idx[CMT_type<Depth, LogWidth>::lanes];
+  int j, ans;
+
+  CMT_Hash(cm, query, idx);
+  ans=cm->counts[idx[0]];
+  for (j=1;j<Depth;j++)
+    if (cm->counts[idx[j]] < ans) ans=cm->counts[idx[j]];
+  return (ans);
+}
+
+#endif
@@ -15,8 +15,15 @@ to Creative Commons, 559 Nathan Abbott Way, Stanford, California
 *********************************************************************/
 
 #include <stdlib.h>
+#include <atomic>
 #include "prng.h"
 #include "countmin.h"
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <xmmintrin.h>
+#define CM_PREFETCH(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+#define CM_PREFETCH(p) __builtin_prefetch(p)
+#endif
 
 #define min(x,y)	((x) < (y) ? (x) : (y))
 #define max(x,y)	((x) > (y) ? (x) : (y))
@@ -127,28 +134,244 @@ void CM_Update(CM_type * cm, unsigned int item, int diff)
   // this can be done more efficiently if the width is a power of two
 }
 
+// The counters of a sketch that CM_AtomicUpdate shares between threads
+// are accessed as atomics. The layouts are the same, so the plain sketch
+// needs no second type.
+static_assert(sizeof(std::atomic<int>) == sizeof(int), "atomic counters");
+static_assert(sizeof(std::atomic<int64_t>) == sizeof(int64_t), "atomic count");
+#define CM_ATOMIC(p) (reinterpret_cast<std::atomic<int> *>(p))
+
 int CM_PointEst(CM_type * cm, unsigned int query)
 {
   // return an estimate of the count of an item by taking the minimum
-  int j, ans;
+  // the loads are relaxed atomics, which are plain loads, so that a query
+  // may run while other threads call CM_AtomicUpdate
+  int j, ans, c;
 
   if (!cm) return 0;
-  ans=cm->counts[0][hash31(cm->hasha[0],cm->hashb[0],query) % cm->width];
+  ans=CM_ATOMIC(&cm->counts[0][hash31(cm->hasha[0],cm->hashb[0],query) % cm->width])
+    ->load(std::memory_order_relaxed);
   for (j=1;j<cm->depth;j++)
-    ans=min(ans,cm->counts[j][hash31(cm->hasha[j],cm->hashb[j],query)%cm->width]);
+    {
+      c=CM_ATOMIC(&cm->counts[j][hash31(cm->hasha[j],cm->hashb[j],query)%cm->width])
+	->load(std::memory_order_relaxed);
+      ans=min(ans,c);
+    }
   // this can be done more efficiently if the width is a power of two
   return (ans);
 }
 
+static void CM_AtomicAdd(CM_type * cm, unsigned int item, int diff)
+{ // the counters of item, but not the total count
+  int j;
+
+  for (j=0;j<cm->depth;j++)
+    CM_ATOMIC(&cm->counts[j][hash31(cm->hasha[j],cm->hashb[j],item) % cm->width])
+      ->fetch_add(diff, std::memory_order_relaxed);
+}
+
+static void CM_AtomicCount(CM_type * cm, int64_t diff)
+{
+  reinterpret_cast<std::atomic<int64_t> *>(&cm->count)
+    ->fetch_add(diff, std::memory_order_relaxed);
+}
+
+void CM_AtomicUpdate(CM_type * cm, unsigned int item, int diff)
+{
+  // as CM_Update, but safe to call from many threads at once
+  if (!cm) return;
+  CM_AtomicCount(cm,diff);
+  CM_AtomicAdd(cm,item,diff);
+}
+
+/************************************************************************/
+/* Per-thread write combining in front of a shared sketch               */
+/************************************************************************/
+
+CMW_type * CMW_Init(CM_type * cm, int slots, int period)
+{     // slots is rounded up to a power of two, at least 2
+  CMW_type * cmw;
+  int n, bits;
+
+  for (n=2,bits=1;n<slots;n<<=1,bits++);
+  cmw=(CMW_type *) calloc(1,sizeof(CMW_type));
+  if (cmw)
+    {
+      cmw->cm=cm;
+      cmw->slots=n;
+      cmw->shift=32-bits;
+      cmw->period=period;
+      cmw->pending=0;
+      cmw->count=0;
+      cmw->items=(unsigned int *) calloc(n,sizeof(unsigned int));
+      cmw->diffs=(int *) calloc(n,sizeof(int));
+      if (!cmw->items || !cmw->diffs)
+	{
+	  free(cmw->items); free(cmw->diffs); free(cmw);
+	  cmw=NULL;
+	}
+    }
+  return cmw;
+}
+
+void CMW_Destroy(CMW_type * cmw)
+{     // flushes what is buffered first
+  if (!cmw) return;
+  CMW_Flush(cmw);
+  free(cmw->items);
+  free(cmw->diffs);
+  free(cmw);
+}
+
+void CMW_Flush(CMW_type * cmw)
+{
+  int i;
+
+  for (i=0;i<cmw->slots;i++)
+    if (cmw->diffs[i]!=0)
+      {
+	CM_AtomicAdd(cmw->cm,cmw->items[i],cmw->diffs[i]);
+	cmw->diffs[i]=0;
+      }
+  // the total count is the most contended word, so it is written once
+  CM_AtomicCount(cmw->cm,cmw->count);
+  cmw->count=0;
+  cmw->pending=0;
+}
+
+void CMW_Update(CMW_type * cmw, unsigned int item, int diff)
+{
+  // The buffer is direct mapped, so an item that keeps coming back stays
+  // in its slot and reaches the shared counters a period's worth at a
+  // time, while a rare item that collides with it is written through.
+  int i=(int) ((item * 2654435761u) >> cmw->shift);
+
+  if (cmw->diffs[i]==0)
+    cmw->items[i]=item;
+  if (cmw->items[i]==item)
+    cmw->diffs[i]+=diff;
+  else
+    {
+      // keep the one that was there, it is the hot one more often
+      CM_AtomicAdd(cmw->cm,item,diff);
+    }
+  cmw->count+=diff;
+  if (++cmw->pending>=cmw->period)
+    CMW_Flush(cmw);
+}
+
+#define CMC_MAXDEPTH 32 // rows whose counters CMC_UpdateEst keeps between passes
+
+int CMC_UpdateEst(CM_type * cm, unsigned int item, int diff)
+{
+  // conservative update: the new estimate is the minimum plus diff, and
+  // every counter is raised to at least that, so with unit updates only
+  // the counters equal to the minimum change
+  int j, ans=0, * c[CMC_MAXDEPTH], * p;
+
+  if (!cm) return 0;
+  cm->count+=diff;
+  for (j=0;j<cm->depth;j++)
+    {
+      p=&cm->counts[j][hash31(cm->hasha[j],cm->hashb[j],item) % cm->width];
+      if (j<CMC_MAXDEPTH) c[j]=p;
+      if (j==0 || *p<ans) ans=*p;
+    }
+  ans+=diff;
+  for (j=0;j<cm->depth;j++)
+    {
+      p=(j<CMC_MAXDEPTH) ? c[j] :
+	&cm->counts[j][hash31(cm->hasha[j],cm->hashb[j],item) % cm->width];
+      if (*p<ans) *p=ans;
+    }
+  return (ans);
+}
+
+void CMC_Update(CM_type * cm, unsigned int item, int diff)
+{
+  CMC_UpdateEst(cm,item,diff);
+}
+
+#define CM_BATCH 64 // keys hashed per pass of a batch query
+
+/*
+Puts hash31(a,b,x) % width of n keys into idx. Inlined, and with a mask
+for a width that is a power of two, the loop vectorizes.
+*/
+template<class Item>
+static inline void CM_HashBatch(int64_t a, int64_t b, const Item * items,
+				int n, int width, unsigned int * idx)
+{
+  int64_t h;
+  int k;
+
+  if ((width & (width-1))==0)
+    for (k=0;k<n;k++)
+      {
+	h=a*(int64_t) items[k]+b;
+	idx[k]=(unsigned int) ((((h >> HL)+h) & MOD) & (width-1));
+      }
+  else
+    for (k=0;k<n;k++)
+      {
+	h=a*(int64_t) items[k]+b;
+	idx[k]=(unsigned int) (((h >> HL)+h) & MOD) % (unsigned int) width;
+      }
+}
+
+/*
+Gathers the counters at idx of a row into est, or their minimum with
+est unless first. The counters are prefetched before the first is read,
+so that their cache misses overlap.
+*/
+static inline void CM_MinBatch(int * row, const unsigned int * idx,
+			       int n, int first, int * est)
+{
+  int k, c;
+
+  for (k=0;k<n;k++)
+    CM_PREFETCH(&row[idx[k]]);
+  for (k=0;k<n;k++)
+    {
+      c=CM_ATOMIC(&row[idx[k]])->load(std::memory_order_relaxed);
+      est[k]=(first) ? c : min(est[k],c);
+    }
+}
+
+void CM_PointEstBatch(CM_type * cm, const unsigned int * items, int n, int * est)
+{
+  // CM_PointEst of n items into est, with no allocation
+  unsigned int idx[CM_BATCH];
+  int i, j, m;
+
+  for (i=0;i<n;i+=CM_BATCH)
+    {
+      m=min(CM_BATCH,n-i);
+      if (!cm)
+	{
+	  for (j=0;j<m;j++) est[i+j]=0;
+	  continue;
+	}
+      for (j=0;j<cm->depth;j++)
+	{
+	  CM_HashBatch(cm->hasha[j],cm->hashb[j],items+i,m,cm->width,idx);
+	  CM_MinBatch(cm->counts[j],idx,m,j==0,est+i);
+	}
+    }
+}
+
+#define CM_MEDDEPTH 32 // rows whose median is taken without allocating
+
 int CM_PointMed(CM_type * cm, unsigned int query)
 {
   // return an estimate of the count by taking the median estimate
   // useful when counts can become negative
   // depth needs to be larger for this to work well
   int j, * ans, result=0;
+  int buf[1+CM_MEDDEPTH];
 
   if (!cm) return 0;
-  ans=(int *) calloc(1+cm->depth,sizeof(int));
+  ans=(cm->depth<=CM_MEDDEPTH) ? buf : (int *) calloc(1+cm->depth,sizeof(int));
   for (j=0;j<cm->depth;j++)
     ans[j+1]=cm->counts[j][hash31(cm->hasha[j],cm->hashb[j],query)%cm->width];
 
@@ -164,6 +387,7 @@ int CM_PointMed(CM_type * cm, unsigned int query)
       }
     else
       result=(MedSelect(1+cm->depth/2,cm->depth,ans));
+  if (ans!=buf) free(ans);
   return result;
   // need to adjust for routine starting at 1
 }
@@ -222,6 +446,7 @@ int64_t CM_F2Est(CM_type * cm)
       ans[j+1]=result;
     }
   result=LLMedSelect((cm->depth+1)/2,cm->depth,ans);
+  free(ans);
   return result;
 }
 
@@ -423,6 +648,183 @@ double CMF_InnerProd(CMF_type * cm1, CMF_type * cm2)
   return result;
 }
 
+/************************************************************************/
+/* Routines to support Count-Min sketches with small cells              */
+/************************************************************************/
+
+#define CMS_TABLE_MIN 16 // slots of the side table to start with
+
+template<class Cell>
+CMS_type<Cell> * CMS_Init(int width, int depth, int seed)
+{     // Initialize the sketch based on user-supplied size
+  CMS_type<Cell> * cm;
+  int j;
+  prng_type * prng;
+
+  cm=(CMS_type<Cell> *) calloc(1,sizeof(CMS_type<Cell>));
+  prng=prng_Init(-abs(seed),2);
+  // the same hash functions as CM_Init with this seed
+
+  if (cm && prng)
+    {
+      cm->depth=depth;
+      cm->width=width;
+      cm->count=0;
+      cm->cells=(Cell *)calloc(sizeof(Cell), (size_t) depth*width);
+      cm->hasha=(unsigned int *)calloc(sizeof(unsigned int),depth);
+      cm->hashb=(unsigned int *)calloc(sizeof(unsigned int),depth);
+      cm->tablesize=CMS_TABLE_MIN;
+      cm->promoted=0;
+      cm->keys=(unsigned int *)calloc(sizeof(unsigned int),cm->tablesize);
+      cm->counts=(int *)calloc(sizeof(int),cm->tablesize);
+      if (cm->cells && cm->hasha && cm->hashb && cm->keys && cm->counts)
+	{
+	  for (j=0;j<depth;j++)
+	    {
+	      cm->hasha[j]=prng_int(prng) & MOD;
+	      cm->hashb[j]=prng_int(prng) & MOD;
+	    }
+	}
+      else
+	{
+	  CMS_Destroy(cm);
+	  cm=NULL;
+	}
+    }
+  if (prng) prng_Destroy(prng);
+  return cm;
+}
+
+template<class Cell>
+void CMS_Destroy(CMS_type<Cell> * cm)
+{     // get rid of a sketch and free up the space
+  if (!cm) return;
+  free(cm->cells);
+  free(cm->hasha);
+  free(cm->hashb);
+  free(cm->keys);
+  free(cm->counts);
+  free(cm);
+}
+
+template<class Cell>
+int CMS_Size(CMS_type<Cell> * cm)
+{ // return the size of the sketch in bytes, with the side table
+  int cells, hashes, table, admin;
+  if (!cm) return 0;
+  admin=sizeof(CMS_type<Cell>);
+  cells=cm->width*cm->depth*sizeof(Cell);
+  hashes=cm->depth*2*sizeof(unsigned int);
+  table=cm->tablesize*(sizeof(unsigned int)+sizeof(int));
+  return(admin + hashes + cells + table);
+}
+
+template<class Cell>
+static inline int * CMS_Slot(CMS_type<Cell> * cm, unsigned int cell)
+{ // the full count of a promoted cell, added if it is new
+  unsigned int key=cell+1;
+  int i=(int) ((key*0x9E3779B97F4A7C15ULL)>>32) & (cm->tablesize-1);
+
+  while (cm->keys[i]!=0)
+    {
+      if (cm->keys[i]==key) return &cm->counts[i];
+      i=(i+1) & (cm->tablesize-1);
+    }
+  cm->keys[i]=key;
+  cm->counts[i]=0;
+  cm->promoted++;
+  return &cm->counts[i];
+}
+
+template<class Cell>
+static void CMS_Grow(CMS_type<Cell> * cm)
+{ // double the side table, which is kept at most half full
+  unsigned int * keys=cm->keys;
+  int * counts=cm->counts;
+  int i, n=cm->tablesize;
+
+  cm->tablesize*=2;
+  cm->promoted=0;
+  cm->keys=(unsigned int *)calloc(sizeof(unsigned int),cm->tablesize);
+  cm->counts=(int *)calloc(sizeof(int),cm->tablesize);
+  for (i=0;i<n;i++)
+    if (keys[i]!=0)
+      *CMS_Slot(cm,keys[i]-1)=counts[i];
+  free(keys);
+  free(counts);
+}
+
+template<class Cell>
+static void CMS_Promote(CMS_type<Cell> * cm, unsigned int cell, int diff)
+{ // add diff to a cell that does not fit or is promoted already
+  const int top=(Cell) ~0; // marks a promoted cell
+  int v=cm->cells[cell];
+
+  if (v!=top)
+    {
+      // promote the cell with its count so far
+      diff+=v;
+      cm->cells[cell]=(Cell) top;
+      if (2*(cm->promoted+1)>cm->tablesize)
+	CMS_Grow(cm);
+    }
+  *CMS_Slot(cm,cell)+=diff;
+}
+
+template<class Cell>
+static inline int CMS_Get(CMS_type<Cell> * cm, unsigned int cell)
+{
+  const int top=(Cell) ~0;
+  int v=cm->cells[cell];
+  return (v!=top) ? v : *CMS_Slot(cm,cell);
+}
+
+template<class Cell>
+void CMS_Update(CMS_type<Cell> * cm, unsigned int item, int diff)
+{
+  const int top=(Cell) ~0;
+  int j, c;
+  unsigned int cell;
+
+  if (!cm) return;
+  cm->count+=diff;
+  for (j=0;j<cm->depth;j++)
+    {
+      cell=j*cm->width+hash31(cm->hasha[j],cm->hashb[j],item) % cm->width;
+      c=cm->cells[cell];
+      if (c!=top && c+diff<top)
+	cm->cells[cell]=(Cell) (c+diff);
+      else
+	CMS_Promote(cm,cell,diff);
+    }
+}
+
+template<class Cell>
+int CMS_PointEst(CMS_type<Cell> * cm, unsigned int query)
+{
+  // return an estimate of the count of an item by taking the minimum
+  int j, ans, c;
+
+  if (!cm) return 0;
+  ans=CMS_Get(cm,hash31(cm->hasha[0],cm->hashb[0],query) % cm->width);
+  for (j=1;j<cm->depth;j++)
+    {
+      c=CMS_Get(cm,j*cm->width+hash31(cm->hasha[j],cm->hashb[j],query) % cm->width);
+      ans=min(ans,c);
+    }
+  return (ans);
+}
+
+#define CMS_INSTANTIATE(Cell) \
+  template CMS_type<Cell> * CMS_Init<Cell>(int, int, int); \
+  template void CMS_Destroy<Cell>(CMS_type<Cell> *); \
+  template int CMS_Size<Cell>(CMS_type<Cell> *); \
+  template void CMS_Update<Cell>(CMS_type<Cell> *, unsigned int, int); \
+  template int CMS_PointEst<Cell>(CMS_type<Cell> *, unsigned int);
+
+CMS_INSTANTIATE(uint8_t)
+CMS_INSTANTIATE(uint16_t)
+
 /************************************************************************/
 /* Routines to support hierarchical Count-Min sketches                  */
 /************************************************************************/
@@ -590,16 +992,64 @@ int CMH_count(CMH_type * cmh, int depth, int item)
   return(estimate);
 }
 
+void CMH_CountBatch(CMH_type * cmh, int depth, const int * items, int n, int * est)
+{
+  // CMH_count of n items at level depth into est, with no allocation
+  unsigned int idx[CM_BATCH];
+  int i, j, k, m;
+
+  for (i=0;i<n;i+=CM_BATCH)
+    {
+      m=min(CM_BATCH,n-i);
+      if (depth>=cmh->levels)
+	for (k=0;k<m;k++) est[i+k]=(int) cmh->count;
+      else if (depth>=cmh->freelim)
+	for (k=0;k<m;k++) est[i+k]=cmh->counts[depth][items[i+k]];
+      else
+	for (j=0;j<cmh->depth;j++)
+	  {
+	    CM_HashBatch(cmh->hasha[depth][j],cmh->hashb[depth][j],items+i,m,
+			 cmh->width,idx);
+	    CM_MinBatch(cmh->counts[depth]+j*cmh->width,idx,m,j==0,est+i);
+	  }
+    }
+}
+
+static void CMH_Descend(CMH_type * cmh, int depth, int start,
+			int thresh, TKSink * sink)
+{
+	// look for heavy hitters below item start of level depth,
+	// estimating its children a batch at a time
+
+	int items[CM_BATCH], est[CM_BATCH];
+	int i, k, m;
+	int blocksize=1<<cmh->gran;
+	int itemshift=start<<cmh->gran;
+
+	for (i=0;i<blocksize;i+=CM_BATCH)
+	{
+		m=min(CM_BATCH,blocksize-i);
+		for (k=0;k<m;k++)
+			items[k]=itemshift+i+k;
+		CMH_CountBatch(cmh,depth-1,items,m,est);
+		for (k=0;k<m;k++)
+		{
+			if (est[k]<thresh) continue;
+			if (depth>1)
+				CMH_Descend(cmh,depth-1,items[k],thresh,sink);
+			else if (sink->n<cmh->width)
+				TK_Report(sink,(uint32_t)items[k],est[k]);
+		}
+	}
+}
+
 void CMH_recursive(CMH_type * cmh, int depth, int start, 
-		    int thresh, std::map<uint32_t, uint32_t>& res)
+		    int thresh, TKSink * sink)
 {
 	// for finding heavy hitters, recursively descend looking 
 	// for ranges that exceed the threshold
 
-	int i;
-	int blocksize;
 	int estcount;
-	int itemshift;
 
 	estcount=CMH_count(cmh,depth,start);
 
@@ -607,21 +1057,12 @@ void CMH_recursive(CMH_type * cmh, int depth, int start,
 	{
 		if (depth==0)
 		{
-			if (res.size()<cmh->width)
-			{
-				res.insert(std::pair<uint32_t, uint32_t>(start, estcount));
-				//results[0]++;
-				//results[results[0]]=start;
-			}
+			if (sink->n<cmh->width)
+				TK_Report(sink,(uint32_t)start,estcount);
 		}
 		else
-		{
-			blocksize=1<<cmh->gran;
-			itemshift=start<<cmh->gran;
 			// assumes that gran is an exact multiple of the bit dept
-			for (i=0;i<blocksize;i++)
-				CMH_recursive(cmh,depth-1,itemshift+i,thresh,res);
-		}
+			CMH_Descend(cmh,depth,start,thresh,sink);
 	}
 }
 
@@ -629,10 +1070,18 @@ std::map<uint32_t, uint32_t> CMH_FindHH(CMH_type * cmh, int thresh)
 {
 	// find all items whose estimated count is greater than phi n
 	std::map<uint32_t, uint32_t> res;
-	CMH_recursive(cmh,cmh->levels,0,thresh,res);
+	TKSink sink=TK_Visitor(TK_Insert<uint32_t, uint32_t>, &res);
+	CMH_recursive(cmh,cmh->levels,0,thresh,&sink);
 	return(res);
 }
 
+int CMH_FindHHTo(CMH_type * cmh, int thresh, TKSink * sink)
+{
+	// report the items whose estimated count is at least thresh to sink
+	CMH_recursive(cmh,cmh->levels,0,thresh,sink);
+	return(sink->n);
+}
+
 int CMH_Rangesum(CMH_type * cmh, int start, int end)
 {
   // compute a range sum: 
@@ -6,6 +6,7 @@
 #define COUNTMIN_h
 
 #include "prng.h"
+#include "topk.h"
 
 //#define min(x,y)	((x) < (y) ? (x) : (y))
 //#define max(x,y)	((x) > (y) ? (x) : (y))
@@ -34,10 +35,43 @@ extern int CM_Size(CM_type *);
 extern void CM_Update(CM_type *, unsigned int, int); 
 extern int CM_PointEst(CM_type *, unsigned int);
 extern int CM_PointMed(CM_type *, unsigned int);
+// CM_PointEst of n items into est, hashing and gathering them in batches
+extern void CM_PointEstBatch(CM_type *, const unsigned int *, int, int *);
 extern int64_t CM_InnerProd(CM_type *, CM_type *);
 extern int CM_Residue(CM_type *, unsigned int *);
 extern int64_t CM_F2Est(CM_type *);
 
+// Thread-safe update of a sketch shared between threads, with relaxed
+// atomic adds. CM_PointEst may run at the same time.
+extern void CM_AtomicUpdate(CM_type *, unsigned int, int);
+
+// A write-combining buffer of one thread in front of a shared sketch. It
+// adds up the updates of the keys that are in its slots and writes them
+// with CM_AtomicUpdate every period updates, so estimates may lag by that
+// much of the thread's weight.
+typedef struct CMW_type{
+  CM_type * cm;
+  int slots; // a power of two
+  int shift; // of the multiplicative hash, to get a slot
+  int period; // updates between flushes
+  int pending; // updates since the last flush
+  int64_t count; // their weight, for the total count of cm
+  unsigned int * items;
+  int * diffs; // 0 for an empty slot
+} CMW_type;
+
+extern CMW_type * CMW_Init(CM_type *, int, int);
+extern void CMW_Destroy(CMW_type *);
+extern void CMW_Update(CMW_type *, unsigned int, int);
+extern void CMW_Flush(CMW_type *);
+
+// Conservative update: only the counters below the new estimate are raised,
+// to it, which cuts the overestimates on skewed streams. diff must not be
+// negative, and a sketch updated this way only supports CM_PointEst.
+// CMC_UpdateEst returns the new estimate of the item.
+extern void CMC_Update(CM_type *, unsigned int, int);
+extern int CMC_UpdateEst(CM_type *, unsigned int, int);
+
 extern CMF_type * CMF_Init(int, int, int);
 extern CMF_type * CMF_Copy(CMF_type *);
 extern void CMF_Destroy(CMF_type *);
@@ -46,6 +80,35 @@ extern void CMF_Update(CMF_type *, unsigned int, double);
 extern double CMF_InnerProd(CMF_type *, CMF_type *);
 extern double CMF_PointProd(CMF_type *, CMF_type *, unsigned int);
 
+// Count-Min with small cells: 8 or 16 bit counters, of which the ones that
+// overflow are promoted to a side table of full counts. Skewed streams
+// leave most cells small, so the sketch takes a quarter or half the space
+// of CM_type at the same width, with the same estimates for the same seed.
+// The sums in the cells must not become negative.
+
+template<class Cell>
+struct CMS_type{
+  int64_t count;
+  int depth;
+  int width;
+  Cell * cells; // depth rows of width, the largest value marks a promoted cell
+  unsigned int *hasha, *hashb;
+  // side table of the promoted cells, open addressing
+  int tablesize; // a power of two
+  int promoted;
+  unsigned int * keys; // cell index + 1, 0 for an empty slot
+  int * counts;
+};
+
+typedef CMS_type<uint8_t> CMS8_type;
+typedef CMS_type<uint16_t> CMS16_type;
+
+template<class Cell> CMS_type<Cell> * CMS_Init(int, int, int);
+template<class Cell> void CMS_Destroy(CMS_type<Cell> *);
+template<class Cell> int CMS_Size(CMS_type<Cell> *);
+template<class Cell> void CMS_Update(CMS_type<Cell> *, unsigned int, int);
+template<class Cell> int CMS_PointEst(CMS_type<Cell> *, unsigned int);
+
 typedef struct CMH_type{
   int64_t count;
   int U; // size of the universe in bits
@@ -65,7 +128,10 @@ extern int CMH_Size(CMH_type *);
 
 extern void CMH_Update(CMH_type *, unsigned int, int);
 extern std::map<uint32_t, uint32_t> CMH_FindHH(CMH_type *, int);
+extern int CMH_FindHHTo(CMH_type *, int, TKSink *);
 extern int CMH_Rangesum(CMH_type *, int, int);
+// the estimates of n items at a level into est, as CM_PointEstBatch
+extern void CMH_CountBatch(CMH_type *, int, const int *, int, int *);
 
 extern int CMH_FindRange(CMH_type * cmh, int);
 extern int CMH_Quantile(CMH_type *cmh,float);
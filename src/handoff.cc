@@ -0,0 +1,68 @@
+#include <limits.h>
+#include <thread>
+#include "handoff.h"
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#pragma comment(lib, "Synchronization.lib")
+#elif defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define HO_CPU_RELAX() _mm_pause()
+#else
+#define HO_CPU_RELAX() std::this_thread::yield()
+#endif
+
+static void HO_FutexWait(std::atomic_int* word, int old) {
+	// sleep while *word == old. May return spuriously.
+#if defined(_WIN32)
+	WaitOnAddress(word, &old, sizeof(int), INFINITE);
+#elif defined(__linux__)
+	syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAIT_PRIVATE, old,
+		NULL, NULL, 0);
+#else
+	std::this_thread::yield();
+#endif
+}
+
+static void HO_FutexWake(std::atomic_int* word) {
+#if defined(_WIN32)
+	WakeByAddressAll(word);
+#elif defined(__linux__)
+	syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAKE_PRIVATE, INT_MAX,
+		NULL, NULL, 0);
+#endif
+}
+
+void HO_WaitForChange(std::atomic_int& word, int old, std::atomic_bool& sleeping) {
+	for (int i = 0; i < HO_SPIN_LIMIT; ++i) {
+		if (word.load(std::memory_order_acquire) != old)
+			return;
+		HO_CPU_RELAX();
+	}
+	// Announce the sleep before the last check, so a concurrent HO_Notify
+	// either sees the flag or changes the word before we check it.
+	sleeping = true;
+	while (word == old) {
+		HO_FutexWait(&word, old);
+	}
+	sleeping = false;
+}
+
+void HO_Notify(std::atomic_int& word, std::atomic_bool& sleeping) {
+	++word;
+	if (sleeping) {
+		HO_FutexWake(&word);
+	}
+}
+
+void HO_Store(std::atomic_int& word, int value, std::atomic_bool& sleeping) {
+	word = value;
+	if (sleeping) {
+		HO_FutexWake(&word);
+	}
+}
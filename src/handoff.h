@@ -0,0 +1,15 @@
+#pragma once
+#include <atomic>
+// handoff.h -- waiting on a word that another thread changes.
+// A waiter spins first and only sleeps in the kernel (futex, or
+// WaitOnAddress on Windows) if the other side is slow. It flags the sleep,
+// so that the changing side makes a system call only when it must.
+
+#define HO_SPIN_LIMIT 4096 // polls before a waiting thread goes to sleep
+
+// Wait until word no longer holds old.
+extern void HO_WaitForChange(std::atomic_int& word, int old, std::atomic_bool& sleeping);
+// Increment word and wake its waiter.
+extern void HO_Notify(std::atomic_int& word, std::atomic_bool& sleeping);
+// Store value to word and wake its waiter.
+extern void HO_Store(std::atomic_int& word, int value, std::atomic_bool& sleeping);
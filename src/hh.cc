@@ -7,9 +7,11 @@ Last modified: December 2016
 *********************************************************************/
 #include "lossycount.h"
 #include "losum.h"
+#include "slosum.h"
 #include "alosum.h"
 #include "ccfc.h"
 #include "countmin.h"
+#include "latency.h"
 #include <fstream>
 
 /******************************************************************/
@@ -39,6 +41,11 @@ void usage()
 		<< "  -g		granularity\n"
 		<< "  -gamma    DIM-SUM coefficient\n"
 		<< "  -z    skew\n"
+		<< "  -b    DIM-SUM and IM-SUM batch size (default: one update at a time)\n"
+		<< "  -shards    also evaluate DIM-SUM sharded over this many writer threads\n"
+		<< "  -latency    time one update in this many with the TSC and report latency percentiles\n"
+		<< "  -budget    ns of maintenance a DIM-SUM update may wait for, and report the schedule\n"
+		<< "  -retract    fraction of packets that retract an earlier packet, a strict turnstile stream\n"
 		<< std::endl;
 }
 
@@ -79,9 +86,10 @@ uint64_t StopTheClock(uint64_t s)
 #endif
 }
 
-void CheckOutput(std::map<uint32_t, uint32_t>& res, uint64_t thresh, size_t hh, Stats& S, const std::vector<uint32_t>& exact)
+template<class Pair>
+void CheckOutput(const Pair* res, size_t claimed, uint64_t thresh, size_t hh, Stats& S, const std::vector<uint32_t>& exact)
 {
-	if (res.empty())
+	if (claimed == 0)
 	{
 		S.F.insert(0.0);
 		S.F2.insert(0.0);
@@ -100,26 +108,27 @@ void CheckOutput(std::map<uint32_t, uint32_t>& res, uint64_t thresh, size_t hh,
 	}
 
 	size_t correct = 0;
-	size_t claimed = res.size();
 	size_t falsepositives = 0;
+	size_t retracted = 0; // false positives of count 0, with no relative error
 	double e = 0.0, e2 = 0.0;
 
-	std::map<uint32_t, uint32_t>::iterator it;
-	for (it = res.begin(); it != res.end(); ++it)
+	for (const Pair* it = res; it != res + claimed; ++it)
 	{
-		if (exact[it->first] >= thresh)
+		uint32_t ex = exact[it->item];
+		uint32_t est = (uint32_t)it->count;
+		double diff = (ex > est) ? ex - est : est - ex;
+		if (ex >= thresh)
 		{
 			++correct;
-			uint32_t ex = exact[it->first];
-			double diff = (ex > it->second) ? ex - it->second : it->second - ex;
 			e += diff / ex;
 		}
 		else
 		{
 			++falsepositives;
-			uint32_t ex = exact[it->first];
-			double diff = (ex > it->second) ? ex - it->second : it->second - ex;
-			e2 += diff / ex;
+			if (ex > 0)
+				e2 += diff / ex;
+			else
+				++retracted;
 		}
 	}
 
@@ -132,9 +141,9 @@ void CheckOutput(std::map<uint32_t, uint32_t>& res, uint64_t thresh, size_t hh,
 	else
 		S.F.insert(0.0);
 
-	if (falsepositives != 0)
+	if (falsepositives > retracted)
 	{
-		e2 /= falsepositives;
+		e2 /= falsepositives - retracted;
 		S.F2.insert(e2);
 		S.dF2 += e2;
 	}
@@ -152,6 +161,22 @@ void CheckOutput(std::map<uint32_t, uint32_t>& res, uint64_t thresh, size_t hh,
 	S.dP += p;
 }
 
+/*
+Runs the threshold query q into buf, which grows until every result fits,
+and returns the number of results.
+*/
+template<class Item, class Weight, class Query>
+size_t QueryInto(std::vector<TKpair_t<Item, Weight>>& buf, Query q)
+{
+	while (true) {
+		TKsink_t<Item, Weight> sink = TK_Buffer(buf.data(), (int)buf.size());
+		q(&sink);
+		if (sink.n <= (int)buf.size())
+			return sink.n;
+		buf.resize(sink.n);
+	}
+}
+
 void PrintTimes(char* title, std::vector<uint64_t> times) {
 	std::cout << title;
 	for (auto const& t : times) {
@@ -221,6 +246,64 @@ void PrintOutput(char* title, size_t size, const Stats& S, size_t u32NumberOfPac
 	);
 }
 
+/*
+Reports every item of [0, domain] whose estimate in cm reaches thresh, the
+only heavy hitter query of a sketch that has point estimates alone.
+*/
+void ScanDomain(CM_type* cm, uint32_t domain, uint64_t thresh, TKSink* sink)
+{
+	const int batch = 1024;
+	unsigned int items[batch];
+	int counts[batch];
+	for (uint64_t from = 0; from <= domain; from += batch) {
+		int n = (int)std::min<uint64_t>(batch, (uint64_t)domain + 1 - from);
+		for (int k = 0; k < n; ++k)
+			items[k] = (unsigned int)(from + k);
+		CM_PointEstBatch(cm, items, n, counts);
+		for (int k = 0; k < n; ++k)
+			if (counts[k] > 0 && (uint64_t)counts[k] >= thresh)
+				TK_Report(sink, items[k], counts[k]);
+	}
+}
+
+/*
+Applies update(i) for i in [from, to). If LH is not NULL, one update in
+every period is timed with the TSC and recorded in LH.
+*/
+template<class Update>
+void RunUpdates(LH_type* LH, size_t period, size_t from, size_t to, Update update)
+{
+	if (LH == NULL) {
+		for (size_t i = from; i < to; ++i)
+			update(i);
+		return;
+	}
+	size_t next = from;
+	for (size_t i = from; i < to; ++i)
+	{
+		if (i == next) {
+			uint64_t s = LH_Now();
+			update(i);
+			LH_Record(LH, LH_Now() - s);
+			next += period;
+		}
+		else
+			update(i);
+	}
+}
+
+void PrintLatency(char* title, LH_type* LH)
+{
+	if (LH->count == 0)
+		return;
+	printf("%s\t%llu\t%llu\t%llu\t%llu\t%llu\n", title,
+		(unsigned long long) LH->count,
+		(unsigned long long) LH_Quantile(LH, 0.5),
+		(unsigned long long) LH_Quantile(LH, 0.99),
+		(unsigned long long) LH_Quantile(LH, 0.999),
+		(unsigned long long) LH->max);
+}
+
 size_t RunExact(uint64_t thresh, std::vector<uint32_t>& exact)
 {
 	size_t hh = 0;
@@ -245,6 +328,11 @@ int main(int argc, char **argv)
 	std::string file = "";
 	bool timeLaspe = false;
 	double dSkew = 1.0;
+	size_t stBatchSize = 0;
+	int nShards = 0;
+	size_t stLatencyPeriod = 0;
+	double dRetract = 0;
+	uint64_t u64Budget = 0;
 	for (int i = 1; i < argc; ++i)
 	{
 		if (strcmp(argv[i], "-np") == 0)
@@ -333,6 +421,56 @@ int main(int argc, char **argv)
 			}
 			dSkew = atof(argv[i]);
 		}
+		else if (strcmp(argv[i], "-b") == 0)
+		{
+			i++;
+			if (i >= argc)
+			{
+				std::cerr << "Missing batch size." << std::endl;
+				return -1;
+			}
+			stBatchSize = atoi(argv[i]);
+		}
+		else if (strcmp(argv[i], "-shards") == 0)
+		{
+			i++;
+			if (i >= argc)
+			{
+				std::cerr << "Missing number of shards." << std::endl;
+				return -1;
+			}
+			nShards = atoi(argv[i]);
+		}
+		else if (strcmp(argv[i], "-latency") == 0)
+		{
+			i++;
+			if (i >= argc)
+			{
+				std::cerr << "Missing latency sampling period." << std::endl;
+				return -1;
+			}
+			stLatencyPeriod = atoi(argv[i]);
+		}
+		else if (strcmp(argv[i], "-budget") == 0)
+		{
+			i++;
+			if (i >= argc)
+			{
+				std::cerr << "Missing latency budget." << std::endl;
+				return -1;
+			}
+			u64Budget = atoll(argv[i]);
+		}
+		else if (strcmp(argv[i], "-retract") == 0)
+		{
+			i++;
+			if (i >= argc)
+			{
+				std::cerr << "Missing fraction of retractions." << std::endl;
+				return -1;
+			}
+			dRetract = atof(argv[i]);
+		}
 		else if (strcmp(argv[i], "-measure_time_granularity") == 0) {
 			uint64_t s;
 			StartTheClock(s);
@@ -359,27 +497,44 @@ int main(int argc, char **argv)
 
 	uint32_t u32DomainSize = 1048575;
 	std::vector<uint32_t> exact(u32DomainSize + 1, 0);
-	Stats SLS, SCM ,SCMH, SCCFC, SALS, SLCL;
-	std::vector<uint64_t> TLS, TCM, TCMH, TCCFC, TALS, TLCL;
+	Stats SLS, SSLS, SCM, SCMC, SCMH, SCCFC, SALS, SLCL;
+	std::vector<uint64_t> TLS, TSLS, TCM, TCMC, TCMH, TCCFC, TALS, TLCL;
 	CMH_type* cmh = CMH_Init(u32Width, u32Depth, 32, u32Granularity);
 	CM_type* cm = CM_Init(u32Width, u32Depth, 0);
+	CM_type* cmc = CM_Init(u32Width, u32Depth, 0); // with conservative update
 	CCFC_type* ccfc = CCFC_Init(u32Width, u32Depth, 32, u32Granularity);
 	LCL_type* lcl = LCL_Init(dPhi);
 	LS_type* ls = LS_Init(dPhi, gamma);
+	LS_SetLatencyBudget(ls, u64Budget);
 	ALS_type* als = ALS_Init(dPhi, gamma);
+	SLS_type* sls = (nShards > 0) ? SLS_Init(dPhi, gamma, nShards) : NULL;
+	// update latency histograms, only with -latency
+	bool latency = stLatencyPeriod > 0;
+	LH_type* LLS = latency ? LH_Init() : NULL;
+	LH_type* LALS = latency ? LH_Init() : NULL;
+	LH_type* LCM = latency ? LH_Init() : NULL;
+	LH_type* LCMC = latency ? LH_Init() : NULL;
+	LH_type* LCMH = latency ? LH_Init() : NULL;
+	LH_type* LCCFC = latency ? LH_Init() : NULL;
+	LH_type* LLCL = latency ? LH_Init() : NULL;
 
 	std::vector<uint32_t> data;
-	std::vector<uint32_t> values;
+	std::vector<int> values;
 	Tools::Random r = Tools::Random(0xF4A54B);
 	Tools::PRGZipf zipf = Tools::PRGZipf(0, u32DomainSize, dSkew, &r);
 
 	size_t stCount = 0;
+	// With retractions only the sketches and DIM-SUM are evaluated, as
+	// IM-SUM and SSH need non-negative weights.
+	bool turnstile = dRetract > 0;
 	if (file != "") {
 		uint64_t total = 0;
 		std::ifstream f(file);
 		int id, length;
 		while (f >> id >> length) {
-			assert(length > 0);
+			assert(length != 0);
+			if (length < 0)
+				turnstile = true;
 			if (total < 0) {
 				std::cerr << "Why is total negative? " << total<<std::endl;
 				break;
@@ -390,13 +545,25 @@ int main(int argc, char **argv)
 			}
 			data.push_back(id);
 			values.push_back(length);
-			total += length;
+			total += abs(length);
 		}
 		std::cerr << "Finished loading file. Total number of bytes: " << total << std::endl;
 	}
 	else {
+		// indices of packets that were not retracted yet
+		std::vector<size_t> live;
 		for (int i = 0; i < stNumberOfPackets; ++i)
 		{
+			if (!live.empty() && r.nextUniformDouble() < dRetract) {
+				size_t j = r.nextUniformUnsignedLong(0, (uint32_t)live.size());
+				data.push_back(data[live[j]]);
+				values.push_back(-values[live[j]]);
+				live[j] = live.back();
+				live.pop_back();
+				continue;
+			}
+			if (turnstile)
+				live.push_back(data.size());
 			++stCount;
 			if (stCount % 500000 == 0)
 				std::cerr << stCount << std::endl;
@@ -417,13 +584,18 @@ int main(int argc, char **argv)
 	uint64_t nsecs;
 	uint64_t t;
 	long long total = 0;
+	long long net = 0; // differs from total with retractions
+	// query results, kept across runs so that queries do not allocate
+	std::vector<TKPair> res(2 * (size_t)ceil(1 / dPhi));
+	std::vector<LS_type::Pair> lsRes(res.size());
 	for (size_t run = 1; run <= stRuns; ++run) // stRuns
 	{
 		bool stop = false;
 		for (size_t i = stStreamPos; i < stStreamPos + stRunSize; ++i)
 		{
-			assert(values[i] > 0);
+			assert(turnstile || values[i] > 0);
 			total += abs((int)values[i]);
+			net += values[i];
 			if (total >= 0x7FFFFFFF) {
 				std::cerr << "Error! Total number of bytes is " << total << std::endl;
 				stop = true;
@@ -441,112 +613,209 @@ int main(int argc, char **argv)
 		if (!gammaDefined) {
 			// we don't want to evaluate these algorithms for those graphs.
 			StartTheClock(nsecs);
-			for (size_t i = stStreamPos; i < stStreamPos + stRunSize; ++i)
-			{
-				CMH_Update(cmh, data[i], values[i]);
-			}
+			RunUpdates(LCMH, stLatencyPeriod, stStreamPos, stStreamPos + stRunSize,
+				[&](size_t i) { CMH_Update(cmh, data[i], values[i]); });
 			SCMH.dU += t = StopTheClock(nsecs);
 			TCMH.push_back(t);
 
 			StartTheClock(nsecs);
-			for (size_t i = stStreamPos; i < stStreamPos + stRunSize; ++i)
-			{
-				CM_Update(cm, data[i], values[i]);
-			}
+			RunUpdates(LCM, stLatencyPeriod, stStreamPos, stStreamPos + stRunSize,
+				[&](size_t i) { CM_Update(cm, data[i], values[i]); });
 			SCM.dU += t = StopTheClock(nsecs);
 			TCM.push_back(t);
 
-			StartTheClock(nsecs);
-			for (size_t i = stStreamPos; i < stStreamPos + stRunSize; ++i)
-			{
-				LCL_Update(lcl, data[i], values[i]);
+			if (!turnstile) {
+				StartTheClock(nsecs);
+				RunUpdates(LCMC, stLatencyPeriod, stStreamPos, stStreamPos + stRunSize,
+					[&](size_t i) { CMC_Update(cmc, data[i], values[i]); });
+				SCMC.dU += t = StopTheClock(nsecs);
+				TCMC.push_back(t);
+			}
+
+			if (!turnstile) {
+				StartTheClock(nsecs);
+				RunUpdates(LLCL, stLatencyPeriod, stStreamPos, stStreamPos + stRunSize,
+					[&](size_t i) { LCL_Update(lcl, data[i], values[i]); });
+				SLCL.dU += t = StopTheClock(nsecs);
+				TLCL.push_back(t);
 			}
-			SLCL.dU += t = StopTheClock(nsecs);
-			TLCL.push_back(t);
 		}
 		StartTheClock(nsecs);
-		for (size_t i = stStreamPos; i < stStreamPos + stRunSize; ++i)
-		{
-			LS_Update(ls, data[i],values[i]);
+		if (stBatchSize > 0) {
+			// with -latency whole batches are timed
+			size_t nBatches = (stRunSize + stBatchSize - 1) / stBatchSize;
+			RunUpdates(LLS, stLatencyPeriod, 0, nBatches, [&](size_t j) {
+				size_t i = stStreamPos + j * stBatchSize;
+				size_t len = std::min(stBatchSize, stStreamPos + stRunSize - i);
+				LS_UpdateBatch(ls, &data[i], &values[i], len);
+			});
+		}
+		else {
+			RunUpdates(LLS, stLatencyPeriod, stStreamPos, stStreamPos + stRunSize,
+				[&](size_t i) { LS_Update(ls, data[i], values[i]); });
 		}
 		SLS.dU += t = StopTheClock(nsecs);
 		TLS.push_back(t);
+
+		if (sls) {
+			StartTheClock(nsecs);
+			size_t len = (stBatchSize > 0) ? stBatchSize : 256;
+			for (size_t i = stStreamPos; i < stStreamPos + stRunSize; i += len)
+			{
+				SLS_UpdateBatch(sls, &data[i], &values[i],
+					std::min(len, stStreamPos + stRunSize - i));
+			}
+			SLS_Flush(sls);
+			SSLS.dU += t = StopTheClock(nsecs);
+			TSLS.push_back(t);
+		}
 		
-		StartTheClock(nsecs);
-		for (size_t i = stStreamPos; i < stStreamPos + stRunSize; ++i)
-		{
-			ALS_Update(als, data[i], values[i]);
+		if (!turnstile) {
+			StartTheClock(nsecs);
+			if (stBatchSize > 0) {
+				size_t nBatches = (stRunSize + stBatchSize - 1) / stBatchSize;
+				RunUpdates(LALS, stLatencyPeriod, 0, nBatches, [&](size_t j) {
+					size_t i = stStreamPos + j * stBatchSize;
+					size_t len = std::min(stBatchSize, stStreamPos + stRunSize - i);
+					ALS_UpdateBatch(als, &data[i], &values[i], len);
+				});
+			}
+			else {
+				RunUpdates(LALS, stLatencyPeriod, stStreamPos, stStreamPos + stRunSize,
+					[&](size_t i) { ALS_Update(als, data[i], values[i]); });
+			}
+			SALS.dU += t = StopTheClock(nsecs);
+			TALS.push_back(t);
 		}
-		SALS.dU += t = StopTheClock(nsecs);
-		TALS.push_back(t);
 		StartTheClock(nsecs);
-		for (size_t i = stStreamPos; i < stStreamPos + stRunSize; ++i)
-		{
-			CCFC_Update(ccfc,data[i],values[i]);      
-		}
+		RunUpdates(LCCFC, stLatencyPeriod, stStreamPos, stStreamPos + stRunSize,
+			[&](size_t i) { CCFC_Update(ccfc, data[i], values[i]); });
 		SCCFC.dU += t = StopTheClock(nsecs);
 		TCCFC.push_back(t);
 
-		uint64_t thresh = static_cast<uint64_t>(floor(dPhi*total)+1);//floor(dPhi * run * stRunSize));
-		std::cerr << "total "<<total<<" thresh " << thresh << std::endl;
+		uint64_t thresh = static_cast<uint64_t>(floor(dPhi*net)+1);//floor(dPhi * run * stRunSize));
+		std::cerr << "total "<<net<<" thresh " << thresh << std::endl;
 		size_t hh = RunExact(thresh, exact);
 		std::cerr << "Run: " << run << ", Exact: " << hh << std::endl;
 
-		std::map<uint32_t, uint32_t> res;
+		size_t claimed;
 		
 		if (!gammaDefined) {
 			// we don't want to evaluate thse algorithms for those graphs
 			StartTheClock(nsecs);
-			res = CMH_FindHH(cmh, thresh);
+			claimed = QueryInto(res, [&](TKSink* sink) { CMH_FindHHTo(cmh, thresh, sink); });
 			SCMH.dQ += StopTheClock(nsecs);
-			CheckOutput(res, thresh, hh, SCMH, exact);
+			CheckOutput(res.data(), claimed, thresh, hh, SCMH, exact);
 			StartTheClock(nsecs);
-			res = LCL_Output(lcl, thresh);
-			SLCL.dQ += StopTheClock(nsecs);
-			CheckOutput(res, thresh, hh, SLCL, exact);
+			claimed = QueryInto(res, [&](TKSink* sink) {
+				ScanDomain(cm, u32DomainSize, thresh, sink); });
+			SCM.dQ += StopTheClock(nsecs);
+			CheckOutput(res.data(), claimed, thresh, hh, SCM, exact);
+			if (!turnstile) {
+				StartTheClock(nsecs);
+				claimed = QueryInto(res, [&](TKSink* sink) {
+					ScanDomain(cmc, u32DomainSize, thresh, sink); });
+				SCMC.dQ += StopTheClock(nsecs);
+				CheckOutput(res.data(), claimed, thresh, hh, SCMC, exact);
+			}
+			if (!turnstile) {
+				StartTheClock(nsecs);
+				claimed = QueryInto(res, [&](TKSink* sink) { LCL_OutputTo(lcl, thresh, sink); });
+				SLCL.dQ += StopTheClock(nsecs);
+				CheckOutput(res.data(), claimed, thresh, hh, SLCL, exact);
+			}
 			StartTheClock(nsecs);
-			res = CCFC_Output(ccfc, thresh);
+			claimed = QueryInto(res, [&](TKSink* sink) { CCFC_OutputTo(ccfc, thresh, sink); });
 			SCCFC.dQ += StopTheClock(nsecs);
-			CheckOutput(res, thresh, hh, SCCFC, exact);
+			CheckOutput(res.data(), claimed, thresh, hh, SCCFC, exact);
 
 		}
 		StartTheClock(nsecs);
-		res = LS_Output(ls, thresh);
+		claimed = QueryInto(lsRes, [&](LS_type::Sink* sink) { LS_OutputTo(ls, thresh, sink); });
 		SLS.dQ += StopTheClock(nsecs);
-		CheckOutput(res, thresh, hh, SLS, exact);
+		CheckOutput(lsRes.data(), claimed, thresh, hh, SLS, exact);
 
-		
-		StartTheClock(nsecs);
-		res = ALS_Output(als, thresh);
-		SLS.dQ += StopTheClock(nsecs);
-		CheckOutput(res, thresh, hh, SALS, exact);
+		if (sls) {
+			StartTheClock(nsecs);
+			claimed = QueryInto(lsRes, [&](LS_type::Sink* sink) { SLS_OutputTo(sls, thresh, sink); });
+			SSLS.dQ += StopTheClock(nsecs);
+			CheckOutput(lsRes.data(), claimed, thresh, hh, SSLS, exact);
+		}
+
+		if (!turnstile) {
+			StartTheClock(nsecs);
+			claimed = QueryInto(res, [&](TKSink* sink) { ALS_OutputTo(als, thresh, sink); });
+			SLS.dQ += StopTheClock(nsecs);
+			CheckOutput(res.data(), claimed, thresh, hh, SALS, exact);
+		}
 		
 		stStreamPos += stRunSize;
 	}
 	if (timeLaspe) {
-		PrintTimes("IM-SUM", TALS);
+		if (!turnstile)
+			PrintTimes("IM-SUM", TALS);
 		PrintTimes("DIM-SUM", TLS);
+		if (sls)
+			PrintTimes("SHARDED-DIM-SUM", TSLS);
 		PrintTimes("CM", TCM);
+		if (!turnstile)
+			PrintTimes("CMC", TCMC);
 		PrintTimes("CMH", TCMH);
 		PrintTimes("CS", TCCFC);
-		PrintTimes("SSH", TLCL);
+		if (!turnstile)
+			PrintTimes("SSH", TLCL);
 	}
 	else {
 		printf("\nMethod\tUpdates/ms\tSpace\tRecall\t5th\t95th\tPrecis\t5th\t95th\tFreq RE\t5th\t95th\n");
 		stNumberOfPackets = data.size();
-		PrintOutput("ALS", ALS_Size(als), SALS, stNumberOfPackets);
+		if (!turnstile)
+			PrintOutput("ALS", ALS_Size(als), SALS, stNumberOfPackets);
 		PrintOutput("LS", LS_Size(ls), SLS, stNumberOfPackets);
+		if (sls)
+			PrintOutput("SLS", SLS_Size(sls), SSLS, stNumberOfPackets);
 		if (!gammaDefined) {
 			PrintOutput("CM", CM_Size(cm), SCM, stNumberOfPackets);
+			if (!turnstile)
+				PrintOutput("CMC", CM_Size(cmc), SCMC, stNumberOfPackets);
 			PrintOutput("CMH", CMH_Size(cmh), SCMH, stNumberOfPackets);
 			PrintOutput("CCFC", CCFC_Size(ccfc), SCCFC, stNumberOfPackets);
-			PrintOutput("SSH", LCL_Size(lcl), SLCL, stNumberOfPackets);
+			if (!turnstile)
+				PrintOutput("SSH", LCL_Size(lcl), SLCL, stNumberOfPackets);
 		}
 	}
+	if (u64Budget > 0) {
+		LSschedule_t schedule;
+		LS_GetSchedule(ls, &schedule);
+		printf("\nBudget\tns/step\tSlice\tSteps/update\tMin gamma\tWaits\tOver budget\n");
+		printf("%llu\t%.2f\t%d\t%.2f\t%.2f\t%llu\t%llu\n", (unsigned long long)schedule.latencyBudget,
+			schedule.nsPerStep, schedule.slice, schedule.stepsPerUpdate, schedule.minGamma,
+			(unsigned long long)schedule.waits, (unsigned long long)schedule.overBudget);
+	}
+	if (latency) {
+		// TSC ticks, including the cost of reading the TSC twice
+		printf("\nMethod\tSamples\tp50\tp99\tp99.9\tMax\n");
+		PrintLatency("ALS", LALS);
+		PrintLatency("LS", LLS);
+		PrintLatency("CM", LCM);
+		PrintLatency("CMC", LCMC);
+		PrintLatency("CMH", LCMH);
+		PrintLatency("CCFC", LCCFC);
+		PrintLatency("SSH", LLCL);
+		LH_Destroy(LALS);
+		LH_Destroy(LLS);
+		LH_Destroy(LCM);
+		LH_Destroy(LCMC);
+		LH_Destroy(LCMH);
+		LH_Destroy(LCCFC);
+		LH_Destroy(LLCL);
+	}
 	CM_Destroy(cm);
+	CM_Destroy(cmc);
 	CMH_Destroy(cmh);
 	LCL_Destroy(lcl);  
 	LS_Destroy(ls);
+	if (sls)
+		SLS_Destroy(sls);
 	ALS_Destroy(als);
 	CCFC_Destroy(ccfc);
 
@@ -0,0 +1,40 @@
+#include <stdlib.h>
+#include <math.h>
+#include "latency.h"
+
+LH_type * LH_Init()
+{
+	return (LH_type *)calloc(1, sizeof(LH_type));
+}
+
+void LH_Destroy(LH_type * LH)
+{
+	free(LH);
+}
+
+static uint64_t LH_BucketEnd(int bucket)
+{ // the largest value that falls in bucket
+	if (bucket < 2 * LH_SUB_BUCKETS)
+		return bucket;
+	int shift = bucket / LH_SUB_BUCKETS - 1;
+	uint64_t start = (uint64_t)(LH_SUB_BUCKETS + bucket % LH_SUB_BUCKETS) << shift;
+	return start + ((uint64_t)1 << shift) - 1;
+}
+
+uint64_t LH_Quantile(LH_type * LH, double q)
+{
+	if (LH->count == 0)
+		return 0;
+	uint64_t rank = (uint64_t)ceil(q * LH->count);
+	if (rank < 1)
+		rank = 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < LH_BUCKETS; ++i) {
+		seen += LH->buckets[i];
+		if (seen >= rank) {
+			uint64_t end = LH_BucketEnd(i);
+			return (end < LH->max) ? end : LH->max;
+		}
+	}
+	return LH->max;
+}
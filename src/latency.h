@@ -0,0 +1,56 @@
+#pragma once
+#include <stdint.h>
+// latency.h -- histograms of update latencies in TSC ticks.
+// Buckets are log-linear as in HDR histograms: every power of two is split
+// into LH_SUB_BUCKETS equal buckets, so a recorded value is known to within
+// 1/LH_SUB_BUCKETS of itself, and recording is a bit scan, a shift and an
+// increment. Values below 2*LH_SUB_BUCKETS are kept exactly.
+
+#define LH_SUB_BITS 4
+#define LH_SUB_BUCKETS (1 << LH_SUB_BITS)
+#define LH_BUCKETS ((65 - LH_SUB_BITS) * LH_SUB_BUCKETS)
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define LH_Now() __rdtsc()
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define LH_Now() __rdtsc()
+#else
+#include <chrono>
+#define LH_Now() ((uint64_t)std::chrono::steady_clock::now().time_since_epoch().count())
+#endif
+
+typedef struct LH_type {
+	uint64_t count; // number of values recorded
+	uint64_t max;
+	uint64_t buckets[LH_BUCKETS];
+} LH_type;
+
+extern LH_type * LH_Init();
+extern void LH_Destroy(LH_type *);
+// The value below which a fraction q of the recorded values fall,
+// rounded up to the end of its bucket.
+extern uint64_t LH_Quantile(LH_type *, double q);
+
+static inline int LH_Bucket(uint64_t value)
+{
+	if (value < 2 * LH_SUB_BUCKETS)
+		return (int)value;
+#if defined(_MSC_VER)
+	unsigned long msb;
+	_BitScanReverse64(&msb, value);
+#else
+	int msb = 63 - __builtin_clzll(value);
+#endif
+	int shift = (int)msb - LH_SUB_BITS;
+	return (shift + 1) * LH_SUB_BUCKETS + (int)((value >> shift) & (LH_SUB_BUCKETS - 1));
+}
+
+static inline void LH_Record(LH_type * LH, uint64_t value)
+{
+	LH->buckets[LH_Bucket(value)]++;
+	LH->count++;
+	if (value > LH->max)
+		LH->max = value;
+}
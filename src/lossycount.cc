@@ -710,14 +710,32 @@ void LCL_Output(LCL_type * lcl) { // prepare for output
 std::map<uint32_t, uint32_t> LCL_Output(LCL_type * lcl, int thresh)
 {
 	std::map<uint32_t, uint32_t> res;
+	TKSink sink=TK_Visitor(TK_Insert<uint32_t, uint32_t>, &res);
+	LCL_OutputTo(lcl,thresh,&sink);
+	return res;
+}
 
+int LCL_OutputTo(LCL_type * lcl, int thresh, TKSink * sink)
+{ // report the items whose count is at least thresh to sink
 	for (int i=1;i<=lcl->size;++i)
 	{
 		if (lcl->counters[i].count>=thresh)
-			res.insert(std::pair<uint32_t, uint32_t>(lcl->counters[i].item, lcl->counters[i].count));
+			TK_Report(sink,lcl->counters[i].item,lcl->counters[i].count);
 	}
+	return sink->n;
+}
 
-	return res;
+int LCL_TopK(LCL_type * lcl, int k, TKPair * out)
+{ // write the k items with the largest counts to out, largest first
+	int n=0;
+	if (k<=0) return 0;
+	for (int i=1;i<=lcl->size;++i)
+	{
+		if (lcl->counters[i].count>0) // unused counters are 0
+			TK_Offer(out,n,k,lcl->counters[i].item,lcl->counters[i].count);
+	}
+	TK_SortTop(out,n);
+	return n;
 }
 
 void LCL_CheckHash(LCL_type * lcl, int item, int hash)
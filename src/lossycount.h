@@ -6,6 +6,7 @@
 #define LOSSYCOUNTING_h
 
 #include "prng.h"
+#include "topk.h"
 
 typedef struct lccounter
 {
@@ -118,6 +119,8 @@ extern int LCL_Size(LCL_type *);
 extern int LCL_PointEst(LCL_type *, LCLitem_t);
 extern int LCL_PointErr(LCL_type *, LCLitem_t);
 extern std::map<uint32_t, uint32_t> LCL_Output(LCL_type *,int);
+extern int LCL_OutputTo(LCL_type *,int,TKSink *);
+extern int LCL_TopK(LCL_type *,int,TKPair *);
 
 //////////////////////////////////////////////////////
 typedef int LCUWT;
@@ -1,103 +1,351 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
 #include "losum.h"
 #include "prng.h"
 #include "math.h"
-#include <windows.h>
+#include "handoff.h"
+#include "quantile.h"
+#include "mapfile.h"
+#include <chrono>
+#include <type_traits>
+#if defined(_WIN32)
+#include <malloc.h>
+#include <intrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define LS_PREFETCH(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+#define LS_PREFETCH(p) __builtin_prefetch(p)
+#endif
 
 #define STEPS_AT_A_TIME 1
-#define BLOCK_SIZE 1
-#define LS_NULLITEM 0x7FFFFFFF
-#define swap(x,y) do{int t=x; x=y; y=t;} while(0)
+#define LS_TIMED_STEPS 1024 // fewest steps in a selection that is timed
+#define LS_STEP_TIME_WEIGHT 0.25 // of the last selection in nsPerStep
+#define LS_BATCH_CHUNK 256 // items hashed ahead by LS_UpdateBatch
+#define LS_PREFETCH_DISTANCE 8 // items between prefetching a chain and using it
 
-inline void LS_FinishStep(LS_type* LS) {
+template<class S>
+inline void LS_FinishStep(S* LS) {
 	--(LS->blocksLeft);
-	if ((--(LS->blocksLeftThisUpdate)) == 0) {
-		if (ReleaseSemaphore(LS->finishUpdateSemaphore, 1, NULL)==0) {
-			int err = GetLastError();
+	if (++(LS->stepsDone) == LS->stepsTarget) {
+		HO_Notify(LS->updateWakeup, LS->updateSleeping);
+	}
+}
+
+/*
+Block the update thread until maintenance reached stepsTarget or finished
+calculating the quantile.
+*/
+template<class S>
+static void LS_WaitForMaintenance(S* LS) {
+	for (bool first = true; ; first = false) {
+		int seq = LS->updateWakeup;
+		if (LS->finishedMedian || (int)(LS->stepsDone - LS->stepsTarget) >= 0)
+			return;
+		if (first)
+			++(LS->waits);
+		// No worker of the pool started on it yet, so take this update's
+		// share of it here. The rest is queued again.
+		if (LS->pool && MP_RunIfQueued(LS->pool, &LS->job, LS->stepsTarget - LS->stepsDone))
+			continue;
+		HO_WaitForChange(LS->updateWakeup, seq, LS->updateSleeping);
+	}
+}
+
+#ifdef LS_BUCKETED_TABLE
+// the tag is taken from hash bits that do not select the bucket
+#define LS_TAG(h, hashsize) ((uint8_t)(0x80 | (((h) / (hashsize)) & 0x7F)))
+#define LS_BYTES(x) (0x0101010101010101ULL * (uint64_t)(x))
+// Sets the top bit of every zero byte of x. Bytes above a zero byte may be
+// flagged too, but the lowest flagged byte is always a zero byte.
+#define LS_ZERO_BYTES(x) (((x) - LS_BYTES(0x01)) & ~(x) & LS_BYTES(0x80))
+
+inline int LS_LowestByte(uint64_t x) {
+#if defined(_MSC_VER)
+	unsigned long i;
+	if (!_BitScanForward(&i, (unsigned long)x)) {
+		_BitScanForward(&i, (unsigned long)(x >> 32));
+		i += 32;
+	}
+	return i / 8;
+#else
+	return __builtin_ctzll(x) / 8;
+#endif
+}
+
+inline uint64_t LS_BucketTags(LSBucket * bucket) {
+	uint64_t tags;
+	memcpy(&tags, bucket->tags, sizeof(tags));
+	return tags;
+}
+
+template<class TableEntry>
+TableEntry * LS_AllocTable(int hashsize) {
+	size_t bytes = hashsize * sizeof(TableEntry);
+#ifdef _MSC_VER
+	TableEntry * table = (TableEntry *)_aligned_malloc(bytes, sizeof(TableEntry));
+#else
+	TableEntry * table = (TableEntry *)aligned_alloc(sizeof(TableEntry), bytes);
+#endif
+	memset(table, 0, bytes);
+	return table;
+}
+
+void LS_FreeTable(LSBucket * table) {
+#ifdef _MSC_VER
+	_aligned_free(table);
+#else
+	free(table);
+#endif
+}
+
+inline void LS_ClearTableEntry(LSBucket * table, int i) {
+	memset(table[i].tags, 0, LS_BUCKET_SLOTS);
+}
+
+/*
+Find item in table, whose slots index counters. h is the hash31 of item.
+Returns NULL if the item is not there.
+*/
+template<class Counter, class Item>
+Counter * LS_TableFind(LSBucket * table, Counter * counters, int hashsize,
+	const Item& item, int h) {
+	int b = h % hashsize;
+	uint64_t tag = LS_BYTES(LS_TAG(h, hashsize));
+	while (true) {
+		uint64_t tags = LS_BucketTags(&table[b]);
+		uint64_t match = LS_ZERO_BYTES(tags ^ tag);
+		while (match) {
+			Counter * counter = &counters[table[b].slots[LS_LowestByte(match)]];
+			if (counter->item == item)
+				return counter;
+			match &= match - 1;
 		}
+		// Items are never removed, so a bucket with a free slot ends the probe.
+		if (LS_ZERO_BYTES(tags))
+			return NULL;
+		if (++b == hashsize)
+			b = 0;
 	}
 }
-void LS_InitPassive(LS_type *LS) {
+
+/*
+Add counters[index] to table, assuming its item is not there yet.
+The tag is written last, so a concurrent lookup sees either no slot or a
+complete one.
+*/
+template<class Counter>
+void LS_TableInsert(LSBucket * table, Counter * counters, int hashsize,
+	int index, int h) {
+	int b = h % hashsize;
+	while (true) {
+		uint64_t empty = LS_ZERO_BYTES(LS_BucketTags(&table[b]));
+		if (empty) {
+			int slot = LS_LowestByte(empty);
+			table[b].slots[slot] = index;
+			std::atomic_thread_fence(std::memory_order_release);
+			table[b].tags[slot] = LS_TAG(h, hashsize);
+			return;
+		}
+		if (++b == hashsize)
+			b = 0;
+	}
+}
+
+template<class Counter>
+inline void LS_PrefetchFirstCounter(LSBucket * table, Counter * counters,
+	int hashsize, int h) {
+	LSBucket * bucket = &table[h % hashsize];
+	uint64_t match = LS_ZERO_BYTES(LS_BucketTags(bucket) ^ LS_BYTES(LS_TAG(h, hashsize)));
+	if (match)
+		LS_PREFETCH(&counters[bucket->slots[LS_LowestByte(match)]]);
+}
+#else
+template<class TableEntry>
+TableEntry * LS_AllocTable(int hashsize) {
+	return (TableEntry *)calloc(hashsize, sizeof(TableEntry));
+}
+
+template<class TableEntry>
+void LS_FreeTable(TableEntry * table) {
+	free(table);
+}
+
+template<class TableEntry>
+inline void LS_ClearTableEntry(TableEntry * table, int i) {
+	table[i] = 0;
+}
+
+/*
+If item was present when the function was called, find it.
+If item was not present when the function finished, return NULL.
+Else, do either.
+Assume: No items are deleted during the runtime of the function.
+*/
+template<class Counter, class Item>
+Counter * LS_TableFind(int32_t * table, Counter * counters, int hashsize,
+	const Item& item, int h) {
+	int32_t link = table[h % hashsize];
+	while (link) {
+		Counter * hashptr = &counters[link - 1];
+		if (hashptr->item == item)
+			return hashptr;
+		link = hashptr->next;
+	}
+	return NULL;
+	// returns NULL if we do not find the item
+}
+
+/*
+Can be executed while LS_TableFind is running.
+*/
+template<class Counter>
+void LS_TableInsert(int32_t * table, Counter * counters, int hashsize,
+	int index, int h) {
+	Counter * counter = &counters[index];
+	// counter goes to the beginning of the list.
+	// The current head of the list becomes the second item in the list.
+	counter->next = table[h % hashsize];
+	// Now put the counter as the new head of the list, once the counter
+	// itself is visible to other threads.
+	std::atomic_thread_fence(std::memory_order_release);
+	table[h % hashsize] = index + 1;
+}
+
+template<class Counter>
+inline void LS_PrefetchFirstCounter(int32_t * table, Counter * counters,
+	int hashsize, int h) {
+	int32_t head = table[h % hashsize];
+	if (head)
+		LS_PREFETCH(&counters[head - 1]);
+}
+#endif
+
+inline int LS_HashItem(int64_t a, int64_t b, uint32_t item) {
+	return (int)hash31(a, b, item);
+}
+
+inline int LS_HashItem(int64_t a, int64_t b, uint64_t item) {
+	// a 32 bit half at a time, so that hash31 does not overflow
+	return (int)hash31(a, hash31(a, b, item & 0xFFFFFFFF), item >> 32);
+}
+
+inline int LS_HashItem(int64_t a, int64_t b, const LSKey128& item) {
+	return LS_HashItem(a, LS_HashItem(a, b, item.lo), item.hi);
+}
+
+// low bits of an item, for the debugging routines
+inline unsigned int LS_ItemLow(uint64_t item) {
+	return (unsigned int)item;
+}
+
+inline unsigned int LS_ItemLow(const LSKey128& item) {
+	return (unsigned int)item.lo;
+}
+
+template<class S>
+inline int LS_Hash(S * LS, const typename S::Item& item) {
+	return LS_HashItem(LS->hasha, LS->hashb, item);
+}
+
+/*
+Steps per passive counter to copy it and find the quantile.
+*/
+template<class S>
+inline int LS_StepsPerItem(S *) {
+	return 1 + QS_Cost<typename S::Weight>::stepsPerItem;
+}
+
+/*
+A passive count in the units of the active counts, which differ for one
+round after maintenance renormalized, see LS_Renormalize.
+*/
+template<class S>
+inline typename S::Weight LS_PassiveCount(S * LS, typename S::Weight count) {
+	double scale = LS->passiveScale.load(std::memory_order_relaxed);
+	return (scale == 1) ? count : (typename S::Weight)(count * scale);
+}
+
+template<class S>
+void LS_InitPassive(S *LS) {
 	for (int i = 0; i < LS->hashsize; ++i) {
 		LS_FinishStep(LS);
-		LS->passiveHashtable[i] = NULL;
+		LS_ClearTableEntry(LS->passiveHashtable.load(std::memory_order_relaxed), i);
 	}
 	LS->nPassive = 0;
 }
 
-LS_type * LS_Init(float fPhi, float gamma)
+template<class S>
+static bool LS_RunMaintenance(void * LS, uint64_t steps);
+
+template<class S>
+S * LS_Init(float fPhi, float gamma)
 {
+	return LS_InitShared<S>(fPhi, gamma, NULL);
+}
+
+template<class S>
+S * LS_InitShared(float fPhi, float gamma, MP_type * pool)
+{
+	float phi = fPhi;
 	fPhi = (float) (1. / (1. / fPhi + 1));
-	int i;
 	int k = 1 + (int) (1.0 / fPhi);
 	
-	LS_type *result = (LS_type *)calloc(1, sizeof(LS_type));
+	S *result = (S *)calloc(1, sizeof(S));
+	result->phi = phi;
+	result->gamma = gamma;
 	// needs to be odd so that the heap always has either both children or 
 	// no children present in the data structure
 	result->epsilon = fPhi;
 	// nitems in large table
 	result->nActive = 0;
 	result->size = int(ceil(gamma / fPhi) + ceil(1 / fPhi) - 1);
+#ifdef LS_BUCKETED_TABLE
+	result->hashsize = (LS_HASHMULT*result->size + LS_BUCKET_SLOTS - 1) / LS_BUCKET_SLOTS;
+#else
 	result->hashsize = LS_HASHMULT*result->size;
-	result->maxMaintenanceTime = 24*result->size + result->hashsize + 1;
+#endif
+	result->maxMaintenanceTime = LS_StepsPerItem(result)*result->size + result->hashsize + 1;
+	result->latencyBudget = 0;
+	result->nsPerStep = 0;
+	result->slice = 0;
 
 	result->hasha = 151261303;
 	result->hashb = 6722461; // hard coded constants for the hash table,
 							 //should really generate these randomly
-	result->n = (LSweight_t)0;
+	result->n = 0;
+	result->epoch = 0;
+	result->published = 0;
+	result->passiveScale = 1;
 
-	result->activeHashtable =
-		(LSCounter **)calloc(result->hashsize, sizeof(LSCounter*));
-	for (i = 0; i < result->hashsize; ++i) {
-		result->activeHashtable[i] = NULL;
-	}
+	// counters past nActive are never compared, so zeroing them is enough
+	result->activeHashtable = LS_AllocTable<typename S::TableEntry>(result->hashsize);
 	result->activeCounters =
-		(LSCounter*)calloc(result->size, sizeof(LSCounter));
-	for (i = 0; i < result->size; i++)
-	{
-		result->activeCounters[i].next = NULL;
-		result->activeCounters[i].item = LS_NULLITEM;
-	}
+		(typename S::Counter*)calloc(result->size, sizeof(typename S::Counter));
 	result->passiveCounters =
-		(LSCounter*)calloc(result->size, sizeof(LSCounter));
-	result->passiveHashtable =
-		(LSCounter **)calloc(result->hashsize, sizeof(LSCounter*));
-	for (int i = 0; i < result->hashsize; ++i) {
-		result->passiveHashtable[i] = NULL;
-	}
+		(typename S::Counter*)calloc(result->size, sizeof(typename S::Counter));
+	result->passiveHashtable = LS_AllocTable<typename S::TableEntry>(result->hashsize);
 	result->nPassive = 0;
 	result->quantile = 0;
 	result->buffer =
-		(int*)calloc(result->size, sizeof(int));
-	result->handle = NULL;	
-	DWORD threadID;
-	result->handle = CreateThread(
-		NULL,                   // default security attributes
-		0,                      // use default stack size
-		LS_Maintenance,         // thread function name
-		result,					// argument to thread function
-		0,                      // use default creation flags
-		&threadID);				// returns the thread identifier
-
-	result->maintenanceStepSemaphore = CreateSemaphore(NULL, 0, 
-		1, NULL);
-	if (result->maintenanceStepSemaphore == NULL) {
-		std::cout << "CreateSemaphore error: " << GetLastError() << std::endl;
-		ExitProcess(3);
-	}
-	result->finishUpdateSemaphore = CreateSemaphore(NULL, 0, 
-		1, NULL);
-	if (result->finishUpdateSemaphore == NULL) {
-		std::cout << "CreateSemaphore error: " << GetLastError() << std::endl;
-		ExitProcess(3);
-	}
-	if (result->handle == NULL)
-	{
-		std::cerr << "Error! Could not create thread!" << std::endl;
-		std::cerr << GetLastError() << std::endl;
-		ExitProcess(3);
-	}
+		(typename S::Weight*)calloc(result->size, sizeof(typename S::Weight));
+	result->scratch =
+		(typename S::Weight*)calloc(result->size, sizeof(typename S::Weight));
+	result->stepsDone = 0;
+	result->stepsTarget = 0;
+	result->maintenanceRequests = 0;
+	result->updateWakeup = 0;
+	result->maintenanceSleeping = false;
+	result->updateSleeping = false;
+	result->done = false;
+	result->pool = pool;
+	if (pool)
+		MP_Register(pool, &result->job, LS_RunMaintenance<S>, result);
+	else
+		result->maintenanceThread = new std::thread(LS_Maintenance<S>, result);
 
 	result->blocksLeft = 0;
 	result->left2Move = 0;
@@ -110,117 +358,143 @@ LS_type * LS_Init(float fPhi, float gamma)
 	return(result);
 }
 
-void LS_DestroyPassive(LS_type* LS) {
-	LS->done = true;
-	ReleaseSemaphore(LS->maintenanceStepSemaphore,1,NULL);
-	free(LS->passiveHashtable);
+template<class S>
+void LS_DestroyPassive(S* LS) {
+	LS_FreeTable(LS->passiveHashtable.load(std::memory_order_relaxed));
 	free(LS->passiveCounters);
 }
-void LS_Destroy(LS_type * LS)
+template<class S>
+void LS_Destroy(S * LS)
 {
 	std::cerr << "Destroy A" << std::endl;
-	free(LS->activeHashtable);
-	free(LS->activeCounters);
-	free(LS->buffer);
-	LS_DestroyPassive(LS);
+	// stop the maintenance thread before freeing the memory it works on
+	if (LS->pool) {
+		MP_Unregister(LS->pool, &LS->job);
+	}
+	else {
+		LS->done = true;
+		HO_Notify(LS->maintenanceRequests, LS->maintenanceSleeping);
+		LS->maintenanceThread->join();
+		delete LS->maintenanceThread;
+	}
+	if (LS->mapping) {
+		// the arrays are in the snapshot that LS_Restore mapped
+		MF_Unmap(LS->mapping, LS->mappingLength);
+	}
+	else {
+		LS_FreeTable(LS->activeHashtable.load(std::memory_order_relaxed));
+		free(LS->activeCounters);
+		free(LS->buffer);
+		free(LS->scratch);
+		LS_DestroyPassive(LS);
+	}
 	free(LS);
 }
 
-
 /*
-If item was present when the function was called, find it.
-If item was not present when the function finished, return NULL.
-Else, do either.
-Assume: No items are deleted during the runtime of the function.
+The update thread brackets what it changes in place, rather than only
+appending counters, with these. Readers on other threads take their copy
+again while the epoch is odd, or if it changed under them. The fields that
+such a change writes are atomics, loaded relaxed by readers.
 */
-LSCounter * LS_FindItemInActive(LS_type * LS, LSitem_t item)
-{ // find a particular item in the date structure and return a pointer to it
-	LSCounter * hashptr;
-	int hashval;
-	hashval = (int)hash31(LS->hasha, LS->hashb, item) % LS->hashsize;
-	hashptr = LS->activeHashtable[hashval];
-	// compute the hash value of the item, and begin to look for it in 
-	// the hash table
-	while (hashptr) {
-		if (hashptr->item == item)
-			break;
-		else hashptr = hashptr->next;
-	}
-	
-	return hashptr;
-	// returns NULL if we do not find the item
+template<class S>
+inline void LS_BeginChange(S * LS) {
+	LS->epoch.store(LS->epoch.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
 }
 
-
-LSCounter** LS_CalculateLocation(LS_type* LS, LSitem_t item) {
-	int hashval;
-	hashval = (int)hash31(LS->hasha, LS->hashb, item) % LS->hashsize;
-	return &(LS->activeHashtable[hashval]);
+template<class S>
+inline void LS_EndChange(S * LS) {
+	LS->epoch.store(LS->epoch.load(std::memory_order_relaxed) + 1, std::memory_order_release);
 }
 
 /*
-If item was present when the function was called, find it.
-If item was not present when the function finished, return NULL.
-Else, do either.
-Assume: No items are deleted during the runtime of the function.
+Empties LS so that it can be reused as if it came from LS_Init, a few
+steps at a time: clears at most steps of the 2 * hashsize table entries,
+from *progress on, which the caller sets to 0 to start. Returns true once
+LS is empty, having waited for a quantile selection still running on the
+maintenance thread. LS must not be updated until then, and readers wait
+for it.
 */
-LSCounter * LS_FindItemInLocation(LS_type * LS, LSitem_t item, LSCounter** location)
-{ // find a particular item in the date structure and return a pointer to it
-	LSCounter * hashptr;
-	hashptr = *location;
-	// compute the hash value of the item, and begin to look for it in 
-	// the hash table
-	while (hashptr) {
-		if (hashptr->item == item)
-			break;
-		else hashptr = hashptr->next;
+template<class S>
+bool LS_ResetSome(S * LS, int * progress, int steps)
+{
+	if (*progress == 0) {
+		// readers retry until LS is empty
+		LS_BeginChange(LS);
 	}
-
-	return hashptr;
+	// counters past nActive and nPassive are never compared, so the tables
+	// are all that needs clearing
+	for (; steps > 0 && *progress < 2 * LS->hashsize; --steps, ++(*progress)) {
+		if (*progress < LS->hashsize)
+			LS_ClearTableEntry(LS->activeHashtable.load(std::memory_order_relaxed), *progress);
+		else
+			LS_ClearTableEntry(LS->passiveHashtable.load(std::memory_order_relaxed), *progress - LS->hashsize);
+	}
+	if (*progress < 2 * LS->hashsize)
+		return false;
+	// The maintenance thread selects a quantile once the copying is done,
+	// unless nothing was passive yet. Of a selection that no worker of the
+	// pool started, a call takes the steps it has left.
+	if (LS->nPassive > 0 && LS->copied2Buffer == LS->nPassive) {
+		while (true) {
+			int seq = LS->updateWakeup;
+			if (LS->finishedMedian)
+				break;
+			if (LS->pool && MP_RunIfQueued(LS->pool, &LS->job, steps)) {
+				if (LS->finishedMedian)
+					break;
+				return false;
+			}
+			HO_WaitForChange(LS->updateWakeup, seq, LS->updateSleeping);
+		}
+	}
+	LS->n = 0;
+	LS->quantile = 0;
+	LS->nActive = 0;
+	LS->nPassive = 0;
+	LS->blocksLeft = 0;
+	LS->left2Move = 0;
+	LS->finishedMedian = false;
+	LS->stepsLeft = 0;
+	LS->movedFromPassive = 0;
+	LS->clearedFromPassive = LS->hashsize;
+	LS->copied2Buffer = 0;
+	LS->passiveScale = 1;
+	LS->published.store(0, std::memory_order_relaxed);
+	LS_EndChange(LS);
+	return true;
 }
 
 
-LSCounter * LS_FindItemInPassive(LS_type * LS, LSitem_t item)
-{ // find a particular item in the data structure and return a pointer to it
-	LSCounter * hashptr;
-	int hashval;
-
-	hashval = (int)(hash31(LS->hasha, LS->hashb, item) % (LS->hashsize));
-	hashptr = LS->passiveHashtable[hashval];
-	// compute the hash value of the item, and begin to look for it in 
-	// the hash table
-
-	while (hashptr) {
-		if (hashptr->item == item)
-			break;
-		else hashptr = hashptr->next;
-	}
-
-	return hashptr;
+template<class S>
+typename S::Counter * LS_FindItemInActive(S * LS, const typename S::Item& item)
+{ // find a particular item in the date structure and return a pointer to it
+	return LS_TableFind(LS->activeHashtable.load(std::memory_order_relaxed),
+		LS->activeCounters.load(std::memory_order_relaxed), LS->hashsize, item, LS_Hash(LS, item));
 	// returns NULL if we do not find the item
 }
 
-LSCounter * LS_FindItemInPassive(LS_type * LS, LSitem_t item, int hashval)
+template<class S>
+typename S::Counter * LS_FindItemInPassive(S * LS, const typename S::Item& item, int h)
 { // find a particular item in the data structure and return a pointer to it
-	LSCounter * hashptr;
-	hashptr = LS->passiveHashtable[hashval];
-	// compute the hash value of the item, and begin to look for it in 
-	// the hash table
-
-	while (hashptr) {
-		if (hashptr->item == item)
-			break;
-		else hashptr = hashptr->next;
-	}
+	return LS_TableFind(LS->passiveHashtable.load(std::memory_order_relaxed),
+		LS->passiveCounters.load(std::memory_order_relaxed), LS->hashsize, item, h);
+	// returns NULL if we do not find the item
+}
 
-	return hashptr;
+template<class S>
+typename S::Counter * LS_FindItemInPassive(S * LS, const typename S::Item& item)
+{ // find a particular item in the data structure and return a pointer to it
+	return LS_FindItemInPassive(LS, item, LS_Hash(LS, item));
 	// returns NULL if we do not find the item
 }
 
 
-LSCounter * LS_FindItem(LS_type * LS, LSitem_t item)
+template<class S>
+typename S::Counter * LS_FindItem(S * LS, const typename S::Item& item)
 { // find a particular item in the data structure and return a pointer to it
-	LSCounter * hashptr;
+	typename S::Counter * hashptr;
 	hashptr = LS_FindItemInActive(LS, item);
 	if (!hashptr) {
 		hashptr = LS_FindItemInPassive(LS, item);
@@ -232,185 +506,210 @@ LSCounter * LS_FindItem(LS_type * LS, LSitem_t item)
 /*
 Can be executed while FindItem or AddItem is running.
 */
-void LS_AddItem(LS_type *LS, LSitem_t item, LSweight_t value) {
-
-	int hashval = (int)hash31(LS->hasha, LS->hashb, item) % LS->hashsize;
+template<class S>
+void LS_AddItem(S *LS, const typename S::Item& item, typename S::Weight value, int h) {
 	// Function should not have been called if there is not enough room in table to insert the item
 	// This applies both to if it's called from maintenance thread and update.
 	assert(LS->nActive < LS->size);
-	LSCounter* counter = &(LS->activeCounters[(LS->nActive)++]);
-	// slot new item into hashtable
-	// counter goes to the beginning of the list.
+	int index = (LS->nActive)++;
+	typename S::Counter* counter = &(LS->activeCounters[index]);
 	// save the current item
 	counter->item = item;
-	// save the current hash
 	counter->count = value;
-	// If we add another item to the same chain we could have a problem here.
-	LSCounter* hashptr = LS->activeHashtable[hashval];
-	// The current head of the list becomes the second item in the list.
-	counter->next = hashptr;
-	// Now put the counter as the new head of the list.
-	LS->activeHashtable[hashval] = counter;
+	// slot new item into hashtable
+	LS_TableInsert(LS->activeHashtable.load(std::memory_order_relaxed),
+		LS->activeCounters.load(std::memory_order_relaxed), LS->hashsize, index, h);
+	LS->published.store(LS->nActive, std::memory_order_release);
+}
+
+template<class S>
+void LS_AddItem(S *LS, const typename S::Item& item, typename S::Weight value) {
+	LS_AddItem(LS, item, value, LS_Hash(LS, item));
 }
 
 /*
-Can be executed while FindItem or AddItem is running.
+The slice of LS_SetLatencyBudget for the current nsPerStep.
 */
-void LS_AddItem2Location(LS_type *LS, LSitem_t item, LSweight_t value, LSCounter** location) {
-	// Function should not have been called if there is not enough room in table to insert the item
-	// This applies both to if it's called from maintenance thread and update.
-	assert(LS->nActive < LS->size);
-	LSCounter* counter = &(LS->activeCounters[(LS->nActive)++]);
-	// slot new item into hashtable
-	// counter goes to the beginning of the list.
-	// save the current item
-	counter->item = item;
-	// save the current hash
-	counter->count = value;
-	// If we add another item to the same chain we could have a problem here.
-	LSCounter* hashptr = *location;
-	// The current head of the list becomes the second item in the list.
-	counter->next = hashptr;
-	// Now put the counter as the new head of the list.
-	*location = counter;
-}
-
-int in_place_find_kth(int *v, int n, int k, int jump, int pivot, LS_type* LS) {
-	assert(k < n);
-	if ((n == 1) && (k == 0)) return v[0];
-	else if (n == 2) {
-		return (v[k*jump] < v[(1 - k)*jump]) ? v[k*jump] : v[(1 - k)*jump];
-	}
-	if (pivot == 0) {
-		int m = (n + 4) / 5; // number of medians
-								//allocate space for medians.
-		for (int i = 0; i < m; i++) {
-			LS_FinishStep(LS);
-			// if quintet is full
-			int to_sort = (n - 5 * i < 3)? (n - 5 * i): 3;
-			int quintet_size = (n - 5 * i < 5) ? (n - 5 * i) : 5;
-			int *w = &v[5 * i * jump];
-			// find 3 smallest items
-			for (int j0 = 0; j0 < to_sort; j0++) {
-				int jmin = j0;
-				for (int j = j0 + 1; j < quintet_size; j++) {
-					if (w[j*jump] < w[jmin*jump]) jmin = j;
-				}
-				swap(w[j0*jump], w[jmin*jump]);
-			}
-		
-		}
-		pivot = in_place_find_kth(v + 2*jump, (n+2)/5, (n + 2) / 5 / 2, jump * 5, 0, LS);
+template<class S>
+static void LS_SetSlice(S * LS) {
+	double nsPerStep = LS->nsPerStep;
+	uint64_t budget = LS->latencyBudget.load(std::memory_order_relaxed);
+	if (budget == 0 || nsPerStep <= 0) {
+		LS->slice = 0;
+		return;
 	}
-	// put smaller items in the beginning
-	int store = 0;
-	for (int i = 0; i < n; i++) {
-		LS_FinishStep(LS);
-		if (v[i*jump] < pivot) {
-			swap(v[i*jump], v[store*jump]);
-			store++;
-		}
-	}
-	// put pivots next
-	int store2 = store;
-	for (int i = store; i < n; i++) {
-		LS_FinishStep(LS);
-		if (v[i*jump] == pivot) {
-			swap(v[i*jump], v[store2*jump]);
-			store2++;
+	double slice = budget / nsPerStep;
+	LS->slice = (slice < 1) ? 1 : (slice > INT_MAX / 2) ? INT_MAX / 2 : (int)slice;
+}
+
+/*
+Called after a part of a selection of 'steps' steps that took ns, to
+follow the speed of the maintenance thread. Short selections are not timed,
+as the clock would be most of what they measure.
+*/
+template<class S>
+static void LS_TimeSteps(S * LS, unsigned int steps, double ns) {
+	if (steps < LS_TIMED_STEPS)
+		return;
+	double last = LS->nsPerStep;
+	double now = ns / steps;
+	LS->nsPerStep = (last == 0) ? now : (1 - LS_STEP_TIME_WEIGHT) * last + LS_STEP_TIME_WEIGHT * now;
+	LS_SetSlice(LS);
+}
+
+/*
+Sets up the quantile selection once the copying is done, for
+LS_SelectSome, unless there are too few passive counts to prune.
+*/
+template<class S>
+static void LS_StartSelection(S* LS) {
+	int k = LS->nPassive - ceil(1 / LS->epsilon);
+	if (k >= 0)
+		QS_Start(&LS->selection, LS->buffer, LS->scratch, (int)LS->nPassive, k,
+			(typename S::Weight)(LS->quantile + 1));
+}
+
+/*
+The work of the maintenance thread, or of the pool, once the copying is
+done: selects the new quantile and releases the update thread. Takes at
+most 'steps' steps of it, and returns whether it is done.
+*/
+template<class S>
+static bool LS_SelectSome(S* LS, uint64_t steps) {
+	//std::cerr << "Calculating median..." << std::endl;
+	int k = LS->nPassive - ceil(1 / LS->epsilon);
+	if (k >= 0) {
+		auto step = [LS]() { LS_FinishStep(LS); };
+		unsigned int stepsBefore = LS->stepsDone;
+		auto start = std::chrono::steady_clock::now();
+		bool done = QS_Run(&LS->selection, steps, step);
+		LS_TimeSteps(LS, LS->stepsDone - stepsBefore, std::chrono::duration<double, std::nano>(
+			std::chrono::steady_clock::now() - start).count());
+		if (!done)
+			return false;
+		if (LS->selection.result > LS->quantile) {
+			LS->quantile = LS->selection.result;
 		}
 	}
-	// if k is small, search for it in the beginning.
-	if (store > k) {
-		//std::cerr << "Beginning:" << std::endl;
-		return in_place_find_kth(v, store, k, jump, 0, LS);
-	}
-	// if k is large, search for it at the end.
-	else if (k >= store2){
-		//std::cerr << "End:" << std::endl;
-		return in_place_find_kth(v + store2*jump, n - store2,
-			k - store2, jump, 0, LS);
-	}
 	else {
-		return pivot;
+		LS->blocksLeft = (LS->hashsize + LS->nPassive) / STEPS_AT_A_TIME + 1;
 	}
+	// Copy passive to active
+	//std::cerr << "Copying P to A..." << std::endl;
+	assert(LS->blocksLeft >= (LS->hashsize + LS->nPassive)/STEPS_AT_A_TIME + 1);
+	LS->blocksLeft = (LS->hashsize + LS->nPassive)/STEPS_AT_A_TIME + 1;
+	
+	LS->finishedMedian = true;
+	// Release update if it is waiting
+	//std::cerr << "Finished maintenance..." << std::endl;
+	HO_Notify(LS->updateWakeup, LS->updateSleeping);
+	return true;
 }
 
-DWORD WINAPI LS_Maintenance(LPVOID lpParam) {
+template<class S>
+void LS_Maintenance(S* LS) {
 	// FINISH MAINTENANCE
-	LS_type* LS = (LS_type*) lpParam;
+	int handled = 0;
 	while (true) {
-		//std::cerr << "Waiting for maintenance semaphore" << std::endl;
-		WaitForSingleObject(LS->maintenanceStepSemaphore, INFINITE);
-		//std::cerr << "Acquired maintenance semaphore" << std::endl;
+		//std::cerr << "Waiting for maintenance request" << std::endl;
+		HO_WaitForChange(LS->maintenanceRequests, handled, LS->maintenanceSleeping);
+		++handled;
 		if (LS->done)
-			return 0;
-		//std::cerr << "Calculating median..." << std::endl;
-		int k = LS->nPassive - ceil(1 / LS->epsilon);
-		if (k >= 0) {
-			int median = in_place_find_kth(LS->buffer, LS->nPassive, k, 1, LS->quantile + 1, LS);
-			if (median > LS->quantile) {
-				LS->quantile = median;
-			}
-		}
-		else {
-			LS->blocksLeft = (LS->hashsize + LS->nPassive) / STEPS_AT_A_TIME + 1;
-		}
-		// Copy passive to active
-		//std::cerr << "Copying P to A..." << std::endl;
-		assert(LS->blocksLeft >= (LS->hashsize + LS->nPassive)/STEPS_AT_A_TIME + 1);
-		LS->blocksLeft = (LS->hashsize + LS->nPassive)/STEPS_AT_A_TIME + 1;
-		
-		LS->finishedMedian = true;
-		// Release update if it is waiting
-		LS->blocksLeftThisUpdate = 0;
-		//std::cerr << "Finished maintenance..." << std::endl;
-		ReleaseSemaphore(LS->finishUpdateSemaphore, 1, NULL);
-		
+			return;
+		LS_SelectSome(LS, UINT64_MAX);
 	}
-	return 0;
+}
+
+template<class S>
+static bool LS_RunMaintenance(void * LS, uint64_t steps) {
+	return LS_SelectSome((S *)LS, steps);
+}
+
+/*
+Hands the quantile selection to the maintenance thread or the pool.
+*/
+template<class S>
+static void LS_RequestMaintenance(S* LS) {
+	if (LS->pool)
+		MP_Submit(LS->pool, &LS->job);
+	else
+		HO_Notify(LS->maintenanceRequests, LS->maintenanceSleeping);
 }
 
 
 
-void LS_RestartMaintenance(LS_type* LS) {
+/*
+With decay, moves the landmark up to the last update once that update
+added more than 2^LS_DECAY_BITS times its weight. The move is a whole
+number of halvings, so the counts rescale exactly. Called at a restart,
+when the new active array is empty, so only the quantile and n must be
+rescaled here, or by LS_RenormalizeInPlace. Returns the factor.
+*/
+template<class S>
+double LS_Renormalize(S * LS) {
+	if (LS->lambda == 0)
+		return 1;
+	double halvings = floor(LS->lambda * (LS->lastTime - LS->landmark) / log(2.0));
+	if (halvings < LS_DECAY_BITS)
+		return 1;
+	LS->landmark += halvings * log(2.0) / LS->lambda;
+	double scale = ldexp(1.0, -(int)std::min(halvings, 4096.0));
+	LS->quantile = (typename S::Weight)(LS->quantile * scale);
+	LS->n = (typename S::Weight)(LS->n * scale);
+	return scale;
+}
+
+template<class S>
+void LS_RestartMaintenance(S* LS) {
+	// From here on the old passive arrays are reused. Readers retry until
+	// the arrays switched roles.
+	LS_BeginChange(LS);
+	LS->published.store(0, std::memory_order_relaxed);
 	// switch counter arrays
-	LSCounter* tmp = LS->activeCounters;
-	LS->activeCounters = LS->passiveCounters;
-	LS->passiveCounters = tmp;
-	LS->nPassive = (int) LS->nActive;
+	typename S::Counter* tmp = LS->activeCounters.load(std::memory_order_relaxed);
+	LS->activeCounters.store(LS->passiveCounters.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	LS->passiveCounters.store(tmp, std::memory_order_relaxed);
+	LS->nPassive.store(LS->nActive, std::memory_order_relaxed);
 	LS->nActive = 0;
+	LS->passiveScale.store(LS_Renormalize(LS), std::memory_order_relaxed);
 	// switch tables
-	LSCounter** tmpTable = LS->activeHashtable;
-	LS->activeHashtable = LS->passiveHashtable;
-	LS->passiveHashtable = tmpTable;
-	LS->blocksLeft = (LS->hashsize + 24*LS->nPassive )/STEPS_AT_A_TIME+1;
+	typename S::TableEntry* tmpTable = LS->activeHashtable.load(std::memory_order_relaxed);
+	LS->activeHashtable.store(LS->passiveHashtable.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	LS->passiveHashtable.store(tmpTable, std::memory_order_relaxed);
+	LS_EndChange(LS);
+	LS->blocksLeft = (LS->hashsize + LS_StepsPerItem(LS)*LS->nPassive)/STEPS_AT_A_TIME+1;
 	
 	int temp = LS->nPassive;
-	LS->left2Move = min(temp, floor(1 / LS->epsilon));
+	LS->left2Move = (temp < floor(1 / LS->epsilon)) ? temp : (int)floor(1 / LS->epsilon);
 	LS->finishedMedian = false;
 	LS->clearedFromPassive = 0;
 	LS->movedFromPassive = 0;
 	LS->copied2Buffer = 0;
 }
 
-void LS_DoUpdate(LS_type * LS, LSitem_t item, LSweight_t value) {
-	LSCounter * hashptr;
+template<class S>
+void LS_DoUpdateAt(S * LS, const typename S::Item& item, typename S::Weight value, int h) {
+	typename S::Counter * hashptr;
 	// find whether new item is already stored, if so store it and add one
 	// update heap property if necessary
 	LS->n += value;
-	int hashval = (int)hash31(LS->hasha, LS->hashb, item) % LS->hashsize;
-	LSCounter** location = &(LS->activeHashtable[hashval]);
-	hashptr = LS_FindItemInLocation(LS, item, location);
+	hashptr = LS_TableFind(LS->activeHashtable.load(std::memory_order_relaxed),
+		LS->activeCounters.load(std::memory_order_relaxed), LS->hashsize, item, h);
 	if (hashptr) {
 		hashptr->count += value; // increment the count of the item
 	}
 	else {
 		// if control reaches here, then we have failed to find the item in the active table.
 		// so, search for it in the passive table
-		hashptr = LS_FindItemInPassive(LS, item, hashval);
+		hashptr = LS_FindItemInPassive(LS, item, h);
 		if (hashptr) {
-			value += hashptr->count;
+			value += LS_PassiveCount(LS, hashptr->count);
+		}
+		else if (value < 0) {
+			// A retraction of an item without a counter. Its count was at
+			// most the quantile and is less now, so the estimate still
+			// bounds it, while a counter of quantile + value would not.
+			return;
 		}
 		else {
 			value += LS->quantile;
@@ -420,24 +719,54 @@ void LS_DoUpdate(LS_type * LS, LSitem_t item, LSweight_t value) {
 		// What if first we check for the item in active and it's missing, 
 		// then the item is copied from the passive table
 		// and then the item is added here?
-		LS_AddItem2Location(LS, item, value, location);
+		LS_AddItem(LS, item, value, h);
 	}
 }
 
-void LS_DoSomeCopying(LS_type * LS) {
+template<class S>
+void LS_DoUpdate(S * LS, const typename S::Item& item, typename S::Weight value) {
+	LS_DoUpdateAt(LS, item, value, LS_Hash(LS, item));
+}
+
+/*
+The number of steps the next 'updates' updates must do, so that stepsLeft
+is done by the time the updatesLeft updates that may follow them are over.
+For a single update this is stepsLeft / (updatesLeft + 1).
+*/
+inline int LS_StepsForUpdates(int stepsLeft, int updates, int updatesLeft) {
+	return (int)((int64_t)stepsLeft * updates / (updatesLeft + updates));
+}
+
+/*
+A phase that ran at LS_StepsForUpdates(stepsLeft, updates, updatesLeft)
+finished after stepsDone steps. Returns how many of the updates it did not
+need, so that a batch can give them to the next phase. A single update is
+always used up.
+*/
+inline int LS_UnusedUpdates(int stepsDone, int stepsLeft, int updates, int updatesLeft) {
+	int used = (int)(((int64_t)stepsDone * (updatesLeft + updates) + stepsLeft - 1) / stepsLeft);
+	if (used < 1)
+		used = 1;
+	return (used < updates) ? updates - used : 0;
+}
+
+template<class S>
+int LS_DoSomeCopying(S * LS, int updates) {
 	int updatesLeft = LS->size - LS->nActive;
 	assert(LS->movedFromPassive == 0);
 	assert(updatesLeft >= 0);
-	LS->stepsLeft = (LS->hashsize + 24 * LS->nPassive) + 1 - LS->copied2Buffer;
-	int stepsLeftThisUpdate = LS->stepsLeft / (updatesLeft + 1);
+	LS->stepsLeft = (LS->hashsize + LS_StepsPerItem(LS) * LS->nPassive) + 1 - LS->copied2Buffer;
+	int stepsLeftThisUpdate = LS_StepsForUpdates(LS->stepsLeft, updates, updatesLeft);
 	int k = LS->nPassive - ceil(1 / LS->epsilon);
+	int copied = 0;
 	if (k >= 0) {
-		for (int i = 0; i < stepsLeftThisUpdate; ++i) {
+		for (; copied < stepsLeftThisUpdate; ++copied) {
 			if (LS->copied2Buffer >= LS->nPassive) {
 				break;
 			}
 			--(LS->blocksLeft);
-			LS->buffer[LS->copied2Buffer] = LS->passiveCounters[LS->copied2Buffer].count;
+			LS->buffer[LS->copied2Buffer] =
+				LS_PassiveCount(LS, LS->passiveCounters[LS->copied2Buffer].count);
 			++(LS->copied2Buffer);
 		}
 	}
@@ -445,40 +774,46 @@ void LS_DoSomeCopying(LS_type * LS) {
 		LS->copied2Buffer = LS->nPassive;
 	}
 	if (LS->copied2Buffer == LS->nPassive) {
-		LS->blocksLeft = (LS->hashsize + 23 * LS->nPassive) / STEPS_AT_A_TIME + 1;
-		ReleaseSemaphore(LS->maintenanceStepSemaphore, 1, NULL);
+		LS->blocksLeft = (LS->hashsize + (LS_StepsPerItem(LS) - 1) * LS->nPassive) / STEPS_AT_A_TIME + 1;
+		LS_StartSelection(LS);
+		LS_RequestMaintenance(LS);
+		return LS_UnusedUpdates(copied, LS->stepsLeft, updates, updatesLeft);
 	}
-	
+	return 0;
 }
 
-void LS_DoSomeClearing(LS_type * LS) {
+template<class S>
+void LS_DoSomeClearing(S * LS, int updates) {
 	int updatesLeft = LS->size - LS->nActive;
 	assert(LS->movedFromPassive == LS->nPassive);
 	assert(LS->left2Move == 0);
 	assert(updatesLeft >= 0);
 	LS->stepsLeft = LS->hashsize - LS->clearedFromPassive;
-	int stepsLeftThisUpdate = LS->stepsLeft / (updatesLeft + 1);
+	int stepsLeftThisUpdate = LS_StepsForUpdates(LS->stepsLeft, updates, updatesLeft);
 	for (int i = 0; i < stepsLeftThisUpdate; ++i) {
-		LS->passiveHashtable[LS->clearedFromPassive++] = NULL;
+		LS_ClearTableEntry(LS->passiveHashtable.load(std::memory_order_relaxed), LS->clearedFromPassive++);
 	}
 }
 
-void LS_DoSomeMoving(LS_type * LS) {
+template<class S>
+int LS_DoSomeMoving(S * LS, int updates) {
 	int updatesLeft = LS->size - LS->nActive - LS->left2Move;
 	LS->stepsLeft = LS->hashsize + LS->nPassive - LS->movedFromPassive;
-	int stepsLeftThisUpdate = LS->stepsLeft / (updatesLeft+1);
+	int stepsLeftThisUpdate = LS_StepsForUpdates(LS->stepsLeft, updates, updatesLeft);
 	int largerThanQuantile = 0;
-	for (int i = 0; i < stepsLeftThisUpdate; ++i) {
-		if (LS->passiveCounters[LS->movedFromPassive].count > LS->quantile) {
-			LSCounter* c = LS_FindItemInActive(LS, LS->passiveCounters[LS->movedFromPassive].item);
+	int moved = 0;
+	while (moved < stepsLeftThisUpdate) {
+		typename S::Weight count = LS_PassiveCount(LS, LS->passiveCounters[LS->movedFromPassive].count);
+		if (count > LS->quantile) {
+			typename S::Counter* c = LS_FindItemInActive(LS, LS->passiveCounters[LS->movedFromPassive].item);
 			if (!c) {
-				LS_AddItem(LS, LS->passiveCounters[LS->movedFromPassive].item,
-					LS->passiveCounters[LS->movedFromPassive].count);
+				LS_AddItem(LS, LS->passiveCounters[LS->movedFromPassive].item, count);
 			}
 			--LS->left2Move;
 			++largerThanQuantile;
 		}
 		(LS->movedFromPassive)++;
+		++moved;
 		if (LS->movedFromPassive >= LS->nPassive) {
 			LS->left2Move = 0;
 			LS->clearedFromPassive = 0;
@@ -488,12 +823,17 @@ void LS_DoSomeMoving(LS_type * LS) {
 	if (LS->nPassive == LS->movedFromPassive) {
 		// If finished moving
 		LS->left2Move = 0;
+		return LS_UnusedUpdates(moved, LS->stepsLeft, updates, updatesLeft);
 	}
+	return 0;
 }
 
-
-void LS_Update(LS_type * LS, LSitem_t item, LSweight_t value)
-{
+/*
+Returns how many more updates can be made before maintenance must
+restart, restarting it first if that number reached zero.
+*/
+template<class S>
+int LS_PrepareUpdates(S * LS) {
 	int updatesLeft = LS->size - LS->nActive - LS->left2Move;
 	if (updatesLeft <= 0) {
 		// Maintenance must be restarted
@@ -508,61 +848,164 @@ void LS_Update(LS_type * LS, LSitem_t item, LSweight_t value)
 		LS_RestartMaintenance(LS);
 		updatesLeft = LS->size - LS->nActive - LS->left2Move;		
 	}
-	// This is the number of steps maintenance must run
-	int blocksLeftThisUpdate = (LS->blocksLeft / updatesLeft);
-	if ((blocksLeftThisUpdate > 0) && (blocksLeftThisUpdate < BLOCK_SIZE)) {
-		blocksLeftThisUpdate = BLOCK_SIZE;
+	return updatesLeft;
+}
+
+/*
+Sets the number of steps maintenance must run during the next 'updates'
+updates, out of the updatesLeft updates that remain. That is an even split
+of the steps left, or with a slice only what the updates after these
+could not do in a slice each.
+*/
+template<class S>
+int LS_ScheduleBlocks(S * LS, int updates, int updatesLeft) {
+	int blocksLeft = LS->blocksLeft;
+	int blocksLeftThisUpdate = (int)((int64_t)blocksLeft * updates / updatesLeft);
+	int64_t slice = LS->slice;
+	if (slice > 0 && slice * updatesLeft >= blocksLeft) {
+		int64_t behind = blocksLeft - slice * (updatesLeft - updates);
+		blocksLeftThisUpdate = (behind > 0) ? (int)behind : 0;
 	}
-	LS->blocksLeftThisUpdate = blocksLeftThisUpdate;
-	// Do actual update
-	LS_DoUpdate(LS, item, value);
-	// Wait for maintenance to finish running if needed
-	if (!(LS->finishedMedian)) {
-		if (LS->copied2Buffer < LS->nPassive) {
-			LS_DoSomeCopying(LS);
+	LS->stepsTarget = LS->stepsDone + blocksLeftThisUpdate;
+	return blocksLeftThisUpdate;
+}
+
+template<class S>
+void LS_SetLatencyBudget(S * LS, uint64_t ns) {
+	LS->latencyBudget.store(ns, std::memory_order_relaxed);
+	LS_SetSlice(LS);
+}
+
+template<class S>
+void LS_GetSchedule(S * LS, LSschedule_t * schedule) {
+	schedule->latencyBudget = LS->latencyBudget.load(std::memory_order_relaxed);
+	schedule->nsPerStep = LS->nsPerStep;
+	schedule->slice = LS->slice;
+	// A round takes at most maxMaintenanceTime steps, and at least
+	// size - 1/epsilon updates, which is about gamma/epsilon.
+	double stepsPerCounter = (double)LS->maxMaintenanceTime / LS->size;
+	schedule->stepsPerUpdate = LS->maxMaintenanceTime / (LS->size - floor(1 / LS->epsilon));
+	// With size = (gamma + 1)/epsilon the even split is
+	// stepsPerCounter * (gamma + 1)/gamma.
+	if (schedule->slice == 0)
+		schedule->minGamma = 0;
+	else if (schedule->slice > stepsPerCounter)
+		schedule->minGamma = stepsPerCounter / (schedule->slice - stepsPerCounter);
+	else
+		schedule->minGamma = HUGE_VAL;
+	schedule->waits = LS->waits;
+	schedule->overBudget = LS->overBudget;
+}
+
+/*
+Advance maintenance by the share of 'updates' updates that were just made.
+A batch of updates may see a phase end. The part of the batch that the
+phase did not need is then passed on to the next phase.
+*/
+template<class S>
+void LS_DoMaintenanceShare(S * LS, int updates, int blocksLeftThisUpdate) {
+	while (updates > 0) {
+		if (!(LS->finishedMedian)) {
+			if (LS->copied2Buffer < LS->nPassive) {
+				updates = LS_DoSomeCopying(LS, updates);
+				continue;
+			}
+			// Wait for maintenance to finish running if needed
+			if (blocksLeftThisUpdate <= 0)
+				return;
+			if (blocksLeftThisUpdate > (int64_t)LS->slice * updates && LS->slice > 0)
+				++(LS->overBudget);
+			unsigned int start = LS->stepsTarget - blocksLeftThisUpdate;
+			LS_WaitForMaintenance(LS);
+			if (!(LS->finishedMedian))
+				return;
+			int progressed = (int)(LS->stepsDone - start);
+			if (progressed > blocksLeftThisUpdate)
+				progressed = blocksLeftThisUpdate;
+			updates = LS_UnusedUpdates(progressed, blocksLeftThisUpdate, updates, 0);
+			blocksLeftThisUpdate = 0;
+		}
+		else if (LS->movedFromPassive < LS->nPassive) {
+			updates = LS_DoSomeMoving(LS, updates);
 		}
-		else if (blocksLeftThisUpdate > 0) {
-			int res;
-			do {
-				res = WaitForSingleObject(LS->finishUpdateSemaphore, 1000);
-				if (res == WAIT_TIMEOUT) {
-					std::cerr << "Waiting for maintenance? DUSHBAG!" << std::endl;
-				}
-				if (res == WAIT_FAILED) {
-					std::cerr << "Error! Wait failed! Code " << GetLastError() << std::endl;
-				}
-			} while (res == WAIT_TIMEOUT);
+		else {
+			LS_DoSomeClearing(LS, updates);
+			return;
 		}
 	}
-	else {
-		if (LS->movedFromPassive < LS->nPassive) {
-			LS_DoSomeMoving(LS);
+}
+
+template<class S>
+void LS_Update(S * LS, typename S::Item item, typename S::Weight value)
+{
+	int updatesLeft = LS_PrepareUpdates(LS);
+	// This is the number of steps maintenance must run
+	int blocksLeftThisUpdate = LS_ScheduleBlocks(LS, 1, updatesLeft);
+	// Do actual update
+	LS_DoUpdate(LS, item, value);
+	LS_DoMaintenanceShare(LS, 1, blocksLeftThisUpdate);
+}
+
+/*
+Same as calling LS_Update on each item in turn, but hashes the items and
+prefetches their buckets ahead of time, and pays for scheduling maintenance
+once per chunk instead of once per item. A chunk never spans a maintenance
+restart, so each item still carries at most its own share of maintenance.
+*/
+template<class S>
+void LS_UpdateBatch(S * LS, const typename S::Item * items, const typename S::Weight * values, size_t n)
+{
+	int hashes[LS_BATCH_CHUNK];
+	size_t done = 0;
+	while (done < n) {
+		int updatesLeft = LS_PrepareUpdates(LS);
+		int m = (int)std::min(n - done, (size_t)LS_BATCH_CHUNK);
+		m = std::min(m, updatesLeft);
+		const typename S::Item* chunk = items + done;
+		for (int i = 0; i < m; ++i) {
+			hashes[i] = LS_Hash(LS, chunk[i]);
+			LS_PREFETCH(&(LS->activeHashtable[hashes[i] % LS->hashsize]));
+			LS_PREFETCH(&(LS->passiveHashtable[hashes[i] % LS->hashsize]));
 		}
-		else {
-			LS_DoSomeClearing(LS);
+		int blocksLeftThisChunk = LS_ScheduleBlocks(LS, m, updatesLeft);
+		for (int i = 0; i < m; ++i) {
+			if (i + LS_PREFETCH_DISTANCE < m) {
+				// the buckets are in cache by now, so fetch the first counters
+				LS_PrefetchFirstCounter(LS->activeHashtable.load(std::memory_order_relaxed), LS->activeCounters.load(std::memory_order_relaxed),
+					LS->hashsize, hashes[i + LS_PREFETCH_DISTANCE]);
+			}
+			LS_DoUpdateAt(LS, chunk[i], values[done + i], hashes[i]);
 		}
+		LS_DoMaintenanceShare(LS, m, blocksLeftThisChunk);
+		done += m;
 	}
 }
 
 
-int LS_Size(LS_type * LS)
+template<class S>
+int LS_Size(S * LS)
 { // return the size of the data structure in bytes
-	return sizeof(LS_type) + LS->size*sizeof(int) // size of median buffer
-		+ 2*(LS->hashsize * sizeof(LSCounter*)) // two hash tables
-		+ 2*(LS->size*sizeof(LSCounter)); // two counter arrays
+	return sizeof(S) + 2*LS->size*sizeof(typename S::Weight) // size of median buffers
+		+ 2*(LS->hashsize * sizeof(typename S::TableEntry)) // two hash tables
+		+ 2*(LS->size*sizeof(typename S::Counter)); // two counter arrays
 }
 
-LSweight_t LS_PointEst(LS_type * LS, LSitem_t item)
+template<class S>
+typename S::Weight LS_PointEst(S * LS, typename S::Item item)
 { // estimate the count of a particular item
-	LSCounter * i;
-	i = LS_FindItem(LS, item);
+	typename S::Counter * i;
+	i = LS_FindItemInActive(LS, item);
 	if (i)
 		return(i->count);
+	i = LS_FindItemInPassive(LS, item);
+	if (i)
+		return LS_PassiveCount(LS, i->count);
 	else
 		return LS->quantile;
 }
 
-LSweight_t LS_PointErr(LS_type * LS, LSitem_t item)
+template<class S>
+typename S::Weight LS_PointErr(S * LS, typename S::Item item)
 { // estimate the worst case error in the estimate of a particular item
 	return LS->quantile;
 }
@@ -575,67 +1018,661 @@ int LS_cmp(const void * a, const void * b) {
 	else return 0;
 }
 
-void LS_Output(LS_type * LS) { // prepare for output
+template<class S>
+std::map<typename S::Item, typename S::Weight> LS_Output(S * LS, uint64_t thresh)
+{
+	std::map<typename S::Item, typename S::Weight> res;
+	typename S::Sink sink = TK_Visitor(TK_Insert<typename S::Item, typename S::Weight>, &res);
+	LS_OutputTo(LS, thresh, &sink);
+	return res;
 }
 
-std::map<uint32_t, uint32_t> LS_Output(LS_type * LS, uint64_t thresh)
+/*
+Reports every item whose count is at least thresh to sink, times unscale,
+and returns how many there are. A passive counter is only looked up in the
+active table once it passes the threshold, as the active one then
+replaces it.
+*/
+template<class S>
+static int LS_ReportAtLeast(S * LS, typename S::Weight thresh, double unscale, typename S::Sink * sink)
 {
-	std::map<uint32_t, uint32_t> res;
+	typedef typename S::Weight Weight;
+	for (int i = 0; i < LS->nActive; ++i) {
+		Weight count = LS->activeCounters[i].count;
+		if (count >= thresh)
+			TK_Report(sink, LS->activeCounters[i].item, (unscale == 1) ? count : (Weight)(count * unscale));
+	}
+	for (int i = 0; i < LS->nPassive; ++i) {
+		Weight count = LS_PassiveCount(LS, LS->passiveCounters[i].count);
+		if (count >= thresh && LS_FindItemInActive(LS, LS->passiveCounters[i].item) == NULL)
+			TK_Report(sink, LS->passiveCounters[i].item, (unscale == 1) ? count : (Weight)(count * unscale));
+	}
+	return sink->n;
+}
 
+template<class S>
+int LS_OutputTo(S * LS, uint64_t thresh, typename S::Sink * sink)
+{
+	return LS_ReportAtLeast(LS, (typename S::Weight)thresh, 1, sink);
+}
+
+/*
+Writes the k items with the largest counts to out, largest first, and
+returns how many there are. The active counters go first, so a passive
+counter is only looked up if it beats the k-th largest active count.
+*/
+template<class S>
+int LS_TopK(S * LS, int k, typename S::Pair * out)
+{
+	int n = 0;
+	if (k <= 0)
+		return 0;
 	for (int i = 0; i < LS->nActive; ++i)
-	{
-		if (LS->activeCounters[i].count >= thresh)
-			res.insert(std::pair<uint32_t, uint32_t>(LS->activeCounters[i].item, 
-				LS->activeCounters[i].count));
-	}
+		TK_Offer(out, n, k, LS->activeCounters[i].item, LS->activeCounters[i].count);
 	for (int i = 0; i < LS->nPassive; ++i) {
-		if ((LS_FindItemInActive(LS, LS->passiveCounters[i].item) == NULL) 
-				&& (LS->passiveCounters[i].count >= thresh)) {
-			res.insert(std::pair<uint32_t, uint32_t>(
-				LS->passiveCounters[i].item, LS->passiveCounters[i].count));
+		typename S::Counter * c = &LS->passiveCounters[i];
+		typename S::Weight count = LS_PassiveCount(LS, c->count);
+		if (TK_Admits(out, n, k, count) && LS_FindItemInActive(LS, c->item) == NULL)
+			TK_Offer(out, n, k, c->item, count);
+	}
+	TK_SortTop(out, n);
+	return n;
+}
+
+template<class S>
+void LS_SetDecay(S * LS, double lambda, double now)
+{ // to be called on an empty summary
+	static_assert(std::is_floating_point<typename S::Weight>::value, "decay needs floating point weights");
+	LS->lambda = lambda;
+	LS->landmark = now;
+	LS->lastTime = now;
+}
+
+template<class S>
+double LS_DecayScale(S * LS, double t)
+{ // what an update of weight 1 at time t adds
+	return exp(LS->lambda * (t - LS->landmark));
+}
+
+/*
+Renormalizes without a restart, for a stream whose items all fit in the
+summary, which never restarts. Done once the counts grew past twice the
+bits a restart waits for, so restarts do it whenever they come. Scales
+every active counter, so the readers are told as at a restart. The
+passive counts only need passiveScale, and the ones copied for a selection
+are scaled along. Put off while the selection runs, as it reads the copies.
+*/
+template<class S>
+static void LS_RenormalizeInPlace(S * LS) {
+	if (LS->lambda * (LS->lastTime - LS->landmark) < 2 * LS_DECAY_BITS * log(2.0))
+		return;
+	if (LS->nPassive > 0 && LS->copied2Buffer == LS->nPassive && !LS->finishedMedian)
+		return;
+	LS_BeginChange(LS);
+	double scale = LS_Renormalize(LS);
+	typename S::Counter * active = LS->activeCounters.load(std::memory_order_relaxed);
+	for (int i = 0; i < LS->nActive; ++i)
+		active[i].count = (typename S::Weight)(active[i].count * scale);
+	LS->passiveScale.store(LS->passiveScale.load(std::memory_order_relaxed) * scale,
+		std::memory_order_relaxed);
+	if (LS->copied2Buffer < LS->nPassive) {
+		for (int i = 0; i < LS->copied2Buffer; ++i)
+			LS->buffer[i] = (typename S::Weight)(LS->buffer[i] * scale);
+	}
+	LS_EndChange(LS);
+}
+
+template<class S>
+void LS_UpdateDecayed(S * LS, typename S::Item item, typename S::Weight value, double t)
+{
+	static_assert(std::is_floating_point<typename S::Weight>::value, "decay needs floating point weights");
+	if (t > LS->lastTime)
+		LS->lastTime = t;
+	LS_RenormalizeInPlace(LS);
+	// as LS_Update, but a restart may renormalize, so scale after it
+	int updatesLeft = LS_PrepareUpdates(LS);
+	int blocksLeftThisUpdate = LS_ScheduleBlocks(LS, 1, updatesLeft);
+	LS_DoUpdate(LS, item, (typename S::Weight)(value * LS_DecayScale(LS, t)));
+	LS_DoMaintenanceShare(LS, 1, blocksLeftThisUpdate);
+}
+
+template<class S>
+typename S::Weight LS_DecayedPointEst(S * LS, typename S::Item item, double t)
+{ // estimate the decayed count of a particular item at time t
+	return (typename S::Weight)(LS_PointEst(LS, item) / LS_DecayScale(LS, t));
+}
+
+/*
+LS_OutputTo for a threshold on the decayed counts at time t, which are
+the counts that are reported.
+*/
+template<class S>
+int LS_DecayedOutputTo(S * LS, double thresh, double t, typename S::Sink * sink)
+{
+	double scale = LS_DecayScale(LS, t);
+	return LS_ReportAtLeast(LS, (typename S::Weight)(thresh * scale), 1 / scale, sink);
+}
+
+/*
+LS_PointEst for threads other than the update thread. The lookup runs
+against the live tables and is retried if maintenance restarted while it
+ran. Between restarts counters are only added, and a counter is complete
+before it can be found.
+*/
+template<class S>
+typename S::Weight LS_ConcurrentPointEst(S * LS, typename S::Item item)
+{
+	while (true) {
+		unsigned int epoch = LS->epoch.load(std::memory_order_acquire);
+		if (epoch & 1) { // a restart is under way
+			std::this_thread::yield();
+			continue;
 		}
+		typename S::Weight est = LS_PointEst(LS, item);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (LS->epoch.load(std::memory_order_relaxed) == epoch)
+			return est;
+	}
+}
+
+template<class S>
+LSreader_t<S> * LS_InitReader(S * LS)
+{
+	LSreader_t<S> * result = (LSreader_t<S> *)calloc(1, sizeof(LSreader_t<S>));
+	result->LS = LS;
+	result->counters =
+		(typename S::Counter *)calloc(2 * LS->size, sizeof(typename S::Counter));
+	return result;
+}
+
+template<class S>
+void LS_DestroyReader(LSreader_t<S> * reader)
+{
+	free(reader->counters);
+	free(reader);
+}
+
+/*
+Copies the counters of the reader's summary into the reader, from any
+thread, while the update thread keeps updating. The update thread never
+waits for a reader. Instead, the copy is a plain sequential read that is
+taken again if maintenance restarted during it, and waits for a restart
+that is under way. Passive counters do not
+change until the restart after they became passive, and active counters
+are only added, so a copy that saw no restart is not torn. A count may be
+older than the counts copied after it, but it is always a count that the
+summary held during the copy.
+*/
+template<class S>
+void LS_Read(LSreader_t<S> * reader)
+{
+	S * LS = reader->LS;
+	while (true) {
+		unsigned int epoch = LS->epoch.load(std::memory_order_acquire);
+		if (epoch & 1) { // a restart is under way
+			std::this_thread::yield();
+			continue;
+		}
+		int nActive = LS->published.load(std::memory_order_acquire);
+		int nPassive = LS->nPassive.load(std::memory_order_relaxed);
+		typename S::Counter * active = LS->activeCounters.load(std::memory_order_relaxed);
+		typename S::Counter * passive = LS->passiveCounters.load(std::memory_order_relaxed);
+		reader->quantile = LS->quantile.load(std::memory_order_relaxed);
+		reader->passiveScale = LS->passiveScale.load(std::memory_order_relaxed);
+		for (int i = 0; i < nActive; ++i)
+			reader->counters[i] = active[i];
+		for (int i = 0; i < nPassive; ++i)
+			reader->counters[nActive + i] = passive[i];
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (LS->epoch.load(std::memory_order_relaxed) == epoch) {
+			reader->nActive = nActive;
+			reader->nPassive = nPassive;
+			return;
+		}
+		++(reader->retries);
+	}
+}
+
+/*
+LS_Output on the copy that the last LS_Read took.
+*/
+template<class S>
+std::map<typename S::Item, typename S::Weight> LS_ReaderOutput(LSreader_t<S> * reader, uint64_t thresh)
+{
+	typedef typename S::Weight Weight;
+	std::map<typename S::Item, Weight> res;
+	Weight least = (Weight)thresh;
+	typename S::Counter * passive = reader->counters + reader->nActive;
+	for (int i = 0; i < reader->nPassive; ++i) {
+		Weight count = (reader->passiveScale == 1) ? passive[i].count
+			: (Weight)(passive[i].count * reader->passiveScale);
+		if (count >= least)
+			res.insert(std::make_pair(passive[i].item, count));
+	}
+	// An item with an active counter is reported by it alone. With
+	// retractions it can be below the passive count.
+	for (int i = 0; i < reader->nActive; ++i) {
+		if (reader->counters[i].count >= least)
+			res[reader->counters[i].item] = reader->counters[i].count;
+		else
+			res.erase(reader->counters[i].item);
 	}
 	return res;
 }
 
-void LS_CheckHash(LS_type * LS, int item, int hash)
+/*
+Calls f on the counter of every item in the summary. An item that is in
+both arrays is only visited in the active one, which holds its current
+count. With retractions that can be below the passive count.
+*/
+template<class S, class F>
+void LS_ForEachCounter(S * LS, F f)
+{
+	for (int i = 0; i < LS->nActive; ++i)
+		f(LS->activeCounters[i]);
+	for (int i = 0; i < LS->nPassive; ++i) {
+		if (LS_FindItemInActive(LS, LS->passiveCounters[i].item) == NULL) {
+			typename S::Counter c = LS->passiveCounters[i];
+			c.count = LS_PassiveCount(LS, c.count);
+			f(c);
+		}
+	}
+}
+
+/*
+Returns a new summary of the two streams that a and b summarize. They
+must come from LS_Init with the same parameters, and must not be updated
+during the merge. Every item gets the sum of its estimates in a and b,
+which is still an upper bound on its count. Then the counters are pruned
+the way maintenance prunes them: the quantile rises to the value that
+only the ceil(1/epsilon) largest sums exceed, and the rest are dropped.
+As with Misra-Gries merging, the error stays within epsilon times the
+combined weight.
+*/
+template<class S>
+S * LS_Merge(S * a, S * b)
+{
+	typedef typename S::Counter Counter;
+	typedef typename S::Weight Weight;
+	assert(a->phi == b->phi && a->gamma == b->gamma);
+	// decayed counts only add up in the same units
+	assert(a->lambda == b->lambda && a->landmark == b->landmark);
+	int capacity = a->nActive + a->nPassive + b->nActive + b->nPassive + 1;
+	Counter * merged = (Counter *)calloc(capacity, sizeof(Counter));
+	Weight * counts = (Weight *)calloc(2 * capacity, sizeof(Weight)); // and selection scratch
+	Weight qa = a->quantile, qb = b->quantile;
+	int m = 0;
+	LS_ForEachCounter(a, [&](const Counter& c) {
+		merged[m].item = c.item;
+		merged[m].count = c.count + LS_PointEst(b, c.item);
+		++m;
+	});
+	LS_ForEachCounter(b, [&](const Counter& c) {
+		if (LS_FindItem(a, c.item) == NULL) {
+			merged[m].item = c.item;
+			merged[m].count = c.count + qa;
+			++m;
+		}
+	});
+	Weight quantile = qa + qb;
+	int k = m - (int)ceil(1 / a->epsilon);
+	if (k >= 0) {
+		for (int i = 0; i < m; ++i)
+			counts[i] = merged[i].count;
+		QS_NoStep step;
+		Weight median = QS_FindKth(counts, counts + m, m, k, (Weight)(quantile + 1), step);
+		if (median > quantile)
+			quantile = median;
+	}
+	S * result = LS_InitShared<S>(a->phi, a->gamma, a->pool);
+	for (int i = 0; i < m; ++i) {
+		if (merged[i].count > quantile)
+			LS_AddItem(result, merged[i].item, merged[i].count);
+	}
+	result->quantile = quantile;
+	result->n = a->n + b->n;
+	result->lambda = a->lambda;
+	result->landmark = a->landmark;
+	result->lastTime = std::max(a->lastTime, b->lastTime);
+	free(merged);
+	free(counts);
+	return result;
+}
+
+/*
+Merges the n summaries pairwise, level by level, so that no summary goes
+through more than log2(n) merges. The inputs are left as they are, and
+the result is a new summary.
+*/
+template<class S>
+S * LS_MergeAll(S ** summaries, int n)
+{
+	assert(n > 0);
+	S ** level = (S **)calloc(n, sizeof(S *));
+	int count = 0;
+	for (int i = 0; i < n; i += 2) {
+		if (i + 1 < n) {
+			level[count++] = LS_Merge(summaries[i], summaries[i + 1]);
+		}
+		else {
+			// copy the odd one out, so that every summary in level is ours
+			S * empty = LS_Init<S>(summaries[i]->phi, summaries[i]->gamma);
+			level[count++] = LS_Merge(summaries[i], empty);
+			LS_Destroy(empty);
+		}
+	}
+	while (count > 1) {
+		int next = 0;
+		for (int i = 0; i < count; i += 2) {
+			if (i + 1 < count) {
+				S * merged = LS_Merge(level[i], level[i + 1]);
+				LS_Destroy(level[i]);
+				LS_Destroy(level[i + 1]);
+				level[next++] = merged;
+			}
+			else {
+				level[next++] = level[i];
+			}
+		}
+		count = next;
+	}
+	S * result = level[0];
+	free(level);
+	return result;
+}
+
+#define LS_SNAPSHOT_MAGIC 0x4D55534D49445344ULL
+#define LS_SNAPSHOT_VERSION 1
+#define LS_SNAPSHOT_ALIGN 64 // arrays start on cache lines, as buckets must
+
+enum {
+	LS_SNAPSHOT_ACTIVE_COUNTERS, LS_SNAPSHOT_PASSIVE_COUNTERS,
+	LS_SNAPSHOT_ACTIVE_TABLE, LS_SNAPSHOT_PASSIVE_TABLE,
+	LS_SNAPSHOT_BUFFER, LS_SNAPSHOT_SCRATCH,
+	LS_SNAPSHOT_ARRAYS
+};
+
+/*
+Header of a snapshot file. The arrays follow at the given offsets, just as
+they are in memory. The tables link counters by their index in the counter
+array, so they stay valid wherever the file is mapped.
+*/
+typedef struct LSsnapshot_t
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t itemSize, weightSize, counterSize, entrySize; // layout of the arrays
+	int32_t nActive, nPassive, left2Move;
+	int32_t hasha, hashb, hashsize;
+	int32_t size, maxMaintenanceTime;
+	int32_t clearedFromPassive, movedFromPassive, stepsLeft, copied2Buffer;
+	int32_t blocksLeft, finishedMedian, medianInFlight;
+	float epsilon, phi, gamma;
+	uint64_t n, quantile;
+	uint64_t offsets[LS_SNAPSHOT_ARRAYS];
+	uint64_t length; // of the whole file
+} LSSnapshot;
+
+/*
+Write bytes of data at offset, padding with zeros from written.
+Zeros are written in place of data if it is NULL.
+*/
+static bool LS_WriteAt(FILE * f, uint64_t & written, uint64_t offset,
+	const void * data, uint64_t bytes)
+{
+	static const char zeros[4096] = { 0 };
+	uint64_t end = data ? offset : offset + bytes;
+	bool ok = true;
+	while (ok && written < end) {
+		size_t n = (size_t)std::min(end - written, (uint64_t)sizeof(zeros));
+		ok = fwrite(zeros, 1, n, f) == n;
+		written += n;
+	}
+	if (ok && data) {
+		ok = fwrite(data, 1, (size_t)bytes, f) == bytes;
+		written += bytes;
+	}
+	return ok;
+}
+
+/*
+Writes LS to path, in one sequential pass. Must be called from the update
+thread, between updates. Maintenance may be in any phase. If the quantile
+is being selected right now, the selection itself is not saved:
+LS_Restore starts it over. The file is written beside path and renamed
+over it, so path always holds a whole snapshot, even if LS was restored
+from it. Returns false if the file could not be written.
+*/
+template<class S>
+bool LS_Snapshot(S * LS, const char * path)
+{
+	if (LS->lambda != 0) {
+		std::cerr << "Error! Snapshots of decayed summaries are not supported" << std::endl;
+		return false;
+	}
+	LSSnapshot header;
+	memset(&header, 0, sizeof(header));
+	// Once finishedMedian is set, the maintenance thread leaves LS alone
+	// until the next restart. Before that it is only busy once the counts
+	// are all in the buffer.
+	bool finished = LS->finishedMedian;
+	bool inFlight = !finished && (LS->copied2Buffer == LS->nPassive);
+	header.magic = LS_SNAPSHOT_MAGIC;
+	header.version = LS_SNAPSHOT_VERSION;
+	header.itemSize = sizeof(typename S::Item);
+	header.weightSize = sizeof(typename S::Weight);
+	header.counterSize = sizeof(typename S::Counter);
+	header.entrySize = sizeof(typename S::TableEntry);
+	header.nActive = LS->nActive;
+	header.nPassive = LS->nPassive;
+	header.left2Move = LS->left2Move;
+	header.hasha = LS->hasha;
+	header.hashb = LS->hashb;
+	header.hashsize = LS->hashsize;
+	header.size = LS->size;
+	header.maxMaintenanceTime = LS->maxMaintenanceTime;
+	header.clearedFromPassive = LS->clearedFromPassive;
+	header.movedFromPassive = LS->movedFromPassive;
+	header.stepsLeft = LS->stepsLeft;
+	header.copied2Buffer = LS->copied2Buffer;
+	header.blocksLeft = LS->blocksLeft;
+	header.finishedMedian = finished;
+	header.medianInFlight = inFlight;
+	header.epsilon = LS->epsilon;
+	header.phi = LS->phi;
+	header.gamma = LS->gamma;
+	header.n = (uint64_t)LS->n;
+	header.quantile = (uint64_t)LS->quantile;
+
+	const void * arrays[LS_SNAPSHOT_ARRAYS] = {
+		LS->activeCounters, LS->passiveCounters,
+		LS->activeHashtable, LS->passiveHashtable,
+		// the buffers are the maintenance thread's while it selects
+		inFlight ? NULL : LS->buffer, inFlight ? NULL : LS->scratch
+	};
+	uint64_t bytes[LS_SNAPSHOT_ARRAYS] = {
+		LS->size * sizeof(typename S::Counter), LS->size * sizeof(typename S::Counter),
+		LS->hashsize * sizeof(typename S::TableEntry), LS->hashsize * sizeof(typename S::TableEntry),
+		LS->size * sizeof(typename S::Weight), LS->size * sizeof(typename S::Weight)
+	};
+	uint64_t offset = sizeof(LSSnapshot);
+	for (int i = 0; i < LS_SNAPSHOT_ARRAYS; ++i) {
+		offset = (offset + LS_SNAPSHOT_ALIGN - 1) / LS_SNAPSHOT_ALIGN * LS_SNAPSHOT_ALIGN;
+		header.offsets[i] = offset;
+		offset += bytes[i];
+	}
+	header.length = offset;
+
+	std::string temp = std::string(path) + ".tmp";
+	FILE * f = fopen(temp.c_str(), "wb");
+	if (f == NULL)
+		return false;
+	uint64_t written = 0;
+	bool ok = LS_WriteAt(f, written, 0, &header, sizeof(header));
+	for (int i = 0; i < LS_SNAPSHOT_ARRAYS; ++i) {
+		ok = ok && LS_WriteAt(f, written, header.offsets[i], arrays[i], bytes[i]);
+	}
+	ok = (fclose(f) == 0) && ok;
+	ok = ok && MF_Replace(temp.c_str(), path);
+	if (!ok)
+		remove(temp.c_str());
+	return ok;
+}
+
+/*
+Adopts a snapshot written by LS_Snapshot. The file is mapped copy on write
+and its arrays are used where they are, so nothing is read or rehashed
+until updates and queries touch it, and the file is never changed.
+Returns NULL if the file cannot be mapped, or was written for another
+summary type or table layout.
+*/
+template<class S>
+S * LS_Restore(const char * path)
+{
+	size_t length;
+	char * base = (char *)MF_MapPrivate(path, &length);
+	if (base == NULL)
+		return NULL;
+	LSSnapshot * header = (LSSnapshot *)base;
+	if ((length < sizeof(LSSnapshot)) || (header->magic != LS_SNAPSHOT_MAGIC)
+		|| (header->version != LS_SNAPSHOT_VERSION) || (header->length != length)
+		|| (header->itemSize != sizeof(typename S::Item))
+		|| (header->weightSize != sizeof(typename S::Weight))
+		|| (header->counterSize != sizeof(typename S::Counter))
+		|| (header->entrySize != sizeof(typename S::TableEntry))) {
+		std::cerr << "Error! " << path << " is not a snapshot of this summary type" << std::endl;
+		MF_Unmap(base, length);
+		return NULL;
+	}
+	S * result = (S *)calloc(1, sizeof(S));
+	result->nActive = header->nActive;
+	result->nPassive = header->nPassive;
+	result->left2Move = header->left2Move;
+	result->hasha = header->hasha;
+	result->hashb = header->hashb;
+	result->hashsize = header->hashsize;
+	result->size = header->size;
+	result->maxMaintenanceTime = header->maxMaintenanceTime;
+	result->clearedFromPassive = header->clearedFromPassive;
+	result->movedFromPassive = header->movedFromPassive;
+	result->stepsLeft = header->stepsLeft;
+	result->copied2Buffer = header->copied2Buffer;
+	result->epsilon = header->epsilon;
+	result->phi = header->phi;
+	result->gamma = header->gamma;
+	result->n = (typename S::Weight)header->n;
+	result->quantile = (typename S::Weight)header->quantile;
+	result->activeCounters = (typename S::Counter *)(base + header->offsets[LS_SNAPSHOT_ACTIVE_COUNTERS]);
+	result->passiveCounters = (typename S::Counter *)(base + header->offsets[LS_SNAPSHOT_PASSIVE_COUNTERS]);
+	result->activeHashtable = (typename S::TableEntry *)(base + header->offsets[LS_SNAPSHOT_ACTIVE_TABLE]);
+	result->passiveHashtable = (typename S::TableEntry *)(base + header->offsets[LS_SNAPSHOT_PASSIVE_TABLE]);
+	result->buffer = (typename S::Weight *)(base + header->offsets[LS_SNAPSHOT_BUFFER]);
+	result->scratch = (typename S::Weight *)(base + header->offsets[LS_SNAPSHOT_SCRATCH]);
+	result->mapping = base;
+	result->mappingLength = length;
+	result->epoch = 0;
+	result->published = result->nActive;
+	result->passiveScale = 1;
+
+	result->stepsDone = 0;
+	result->stepsTarget = 0;
+	result->maintenanceRequests = 0;
+	result->updateWakeup = 0;
+	result->maintenanceSleeping = false;
+	result->updateSleeping = false;
+	result->done = false;
+	result->finishedMedian = (header->finishedMedian != 0);
+	result->blocksLeft = header->blocksLeft;
+	if (header->medianInFlight) {
+		// The selection was lost with the process that wrote the snapshot.
+		// Copy the counts again and let the new maintenance thread redo it.
+		for (int i = 0; i < result->nPassive; ++i)
+			result->buffer[i] = result->passiveCounters[i].count;
+		result->blocksLeft = (result->hashsize
+			+ (LS_StepsPerItem(result) - 1) * result->nPassive) / STEPS_AT_A_TIME + 1;
+		LS_StartSelection(result);
+		result->maintenanceRequests = 1;
+	}
+	result->maintenanceThread = new std::thread(LS_Maintenance<S>, result);
+	return result;
+}
+
+#ifdef LS_BUCKETED_TABLE
+template<class S>
+void LS_CheckHash(S * LS, int item, int hash)
+{ // debugging routine to validate the hash table
+	for (int i = 0; i < LS->nActive; i++)
+	{
+		if (LS_FindItemInActive(LS, LS->activeCounters[i].item) != &LS->activeCounters[i])
+		{
+			printf("\n Counter %d (item %u) cannot be found in the table\n", i,
+				LS_ItemLow(LS->activeCounters[i].item));
+			printf("after inserting item %d with hash %d\n", item, hash);
+		}
+	}
+}
+
+template<class S>
+void LS_ShowHash(S * LS)
+{ // debugging routine to show the hashtable
+	for (int i = 0; i < LS->hashsize; i++)
+	{
+		printf("%d:", i);
+		for (int j = 0; j < LS_BUCKET_SLOTS; j++) {
+			if (LS->activeHashtable[i].tags[j])
+				printf(" [%02x] %u", LS->activeHashtable[i].tags[j],
+					LS_ItemLow(LS->activeCounters[LS->activeHashtable[i].slots[j]].item));
+		}
+		printf(" *** \n");
+	}
+}
+#else
+template<class S>
+void LS_CheckHash(S * LS, int item, int hash)
 { // debugging routine to validate the hash table
 	int i;
-	LSCounter *hashptr, *prev;
+	int32_t link;
 
 	for (i = 0; i<LS->hashsize; i++)
 	{
-		prev = NULL;
-		hashptr = LS->activeHashtable[i];
-		while (hashptr) {
-			prev = hashptr;
-			hashptr = hashptr->next;
+		link = LS->activeHashtable[i];
+		while (link) {
+			if (link < 0 || link > LS->nActive)
+			{
+				printf("\n Link violation! link = %d, nActive = %d\n", link, LS->nActive);
+				printf("after inserting item %d with hash %d\n", item, hash);
+				break;
+			}
+			link = LS->activeCounters[link - 1].next;
 		}
 	}
 }
 
-void LS_ShowHash(LS_type * LS)
+template<class S>
+void LS_ShowHash(S * LS)
 { // debugging routine to show the hashtable
 	int i;
-	LSCounter * hashptr;
+	int32_t link;
 
 	for (i = 0; i<LS->hashsize; i++)
 	{
 		printf("%d:", i);
-		hashptr = LS->activeHashtable[i];
-		while (hashptr) {
-			printf(" %d [h(%u) = ?, prev = ?] ---> ", (int)hashptr,
-				(unsigned int)hashptr->item);
+		link = LS->activeHashtable[i];
+		while (link) {
+			printf(" %d [h(%u) = ?, prev = ?] ---> ", link - 1,
+				LS_ItemLow(LS->activeCounters[link - 1].item));
 				//hashptr->hash);//,
 				//hashptr->prev);
-			hashptr = hashptr->next;
+			link = LS->activeCounters[link - 1].next;
 		}
 		printf(" *** \n");
 	}
 }
+#endif
 
 
-void LS_ShowHeap(LS_type * LS)
+template<class S>
+void LS_ShowHeap(S * LS)
 { // debugging routine to show the heap
 	int i, j;
 
@@ -651,3 +1688,46 @@ void LS_ShowHeap(LS_type * LS)
 	}
 	printf("\n\n");
 }
+
+#define LS_INSTANTIATE(S) \
+	template S * LS_Init<S>(float, float); \
+	template S * LS_InitShared<S>(float, float, MP_type *); \
+	template void LS_Destroy<S>(S *); \
+	template void LS_Update<S>(S *, S::Item, S::Weight); \
+	template void LS_UpdateBatch<S>(S *, const S::Item *, const S::Weight *, size_t); \
+	template int LS_Size<S>(S *); \
+	template S::Weight LS_PointEst<S>(S *, S::Item); \
+	template S::Weight LS_PointErr<S>(S *, S::Item); \
+	template void LS_CheckHash<S>(S *, int, int); \
+	template std::map<S::Item, S::Weight> LS_Output<S>(S *, uint64_t); \
+	template int LS_OutputTo<S>(S *, uint64_t, S::Sink *); \
+	template int LS_TopK<S>(S *, int, S::Pair *); \
+	template void LS_Maintenance<S>(S *); \
+	template bool LS_ResetSome<S>(S *, int *, int); \
+	template S::Counter * LS_FindItem<S>(S *, const S::Item&); \
+	template S * LS_Merge<S>(S *, S *); \
+	template S * LS_MergeAll<S>(S **, int); \
+	template bool LS_Snapshot<S>(S *, const char *); \
+	template S * LS_Restore<S>(const char *); \
+	template S::Weight LS_ConcurrentPointEst<S>(S *, S::Item); \
+	template LSreader_t<S> * LS_InitReader<S>(S *); \
+	template void LS_DestroyReader<S>(LSreader_t<S> *); \
+	template void LS_Read<S>(LSreader_t<S> *); \
+	template std::map<S::Item, S::Weight> LS_ReaderOutput<S>(LSreader_t<S> *, uint64_t); \
+	template void LS_SetLatencyBudget<S>(S *, uint64_t); \
+	template void LS_GetSchedule<S>(S *, LSschedule_t *);
+
+// only for floating point weights
+#define LS_INSTANTIATE_DECAY(S) \
+	template void LS_SetDecay<S>(S *, double, double); \
+	template double LS_DecayScale<S>(S *, double); \
+	template void LS_UpdateDecayed<S>(S *, S::Item, S::Weight, double); \
+	template S::Weight LS_DecayedPointEst<S>(S *, S::Item, double); \
+	template int LS_DecayedOutputTo<S>(S *, double, double, S::Sink *);
+
+LS_INSTANTIATE(LS_type)
+LS_INSTANTIATE(LSBytes_type)
+LS_INSTANTIATE(LS64_type)
+LS_INSTANTIATE(LS128_type)
+LS_INSTANTIATE(LSDecay_type)
+LS_INSTANTIATE_DECAY(LSDecay_type)
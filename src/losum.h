@@ -1,7 +1,10 @@
 #pragma once
 #include "prng.h"
-#include <windows.h>
+#include "topk.h"
+#include "mpool.h"
+#include "quantile.h"
 #include<atomic>
+#include<thread>
 // losum.h -- header file for Lossy Summing
 
 /////////////////////////////////////////////////////////
@@ -14,51 +17,221 @@
 #define LSitem_t uint32_t
 #define LSAtomicItem_t std::atomic<LSitem_t>
 
-typedef struct LScounter_t LSCounter;
+// Keys wider than 64 bits, such as IPv6 address pairs or 5-tuples.
+typedef struct LSkey128_t
+{
+	uint64_t lo, hi;
+} LSKey128;
+
+inline bool operator==(const LSKey128& x, const LSKey128& y) {
+	return x.lo == y.lo && x.hi == y.hi;
+}
+inline bool operator<(const LSKey128& x, const LSKey128& y) {
+	return x.hi < y.hi || (x.hi == y.hi && x.lo < y.lo);
+}
 
+template<class Item, class Weight>
 struct LScounter_t
 {
-	LSitem_t item; // item identifier
-	LSweight_t count; // (upper bound on) count for the item
-	LSCounter* next;
+	Item item; // item identifier
+	Weight count; // (upper bound on) count for the item
+#ifndef LS_BUCKETED_TABLE
+	int32_t next; // index + 1 of the next counter in the chain, 0 ends it
 	// Table does not support removals therefore does not define prev,
-}; // 32 bytes
+#endif
+}; // 12 bytes for 32 bit items and weights
+
+typedef LScounter_t<LSitem_t, LSweight_t> LSCounter;
 
 #define LS_HASHMULT 3  // how big to make the hashtable of elements:
    // multiply 1/eps by this amount
    // about 3 seems to work well
 
+//#define LS_BUCKETED_TABLE // alternate hash table layout, see below
+#ifdef LS_BUCKETED_TABLE
+// Open addressing over cache line sized buckets instead of chaining.
+// Each slot has a tag byte taken from the hash of its item, so a lookup
+// reads one bucket and only touches counters whose tag matches.
+#define LS_BUCKET_SLOTS 8
+
+typedef struct alignas(64) LSbucket_t
+{
+	uint8_t tags[LS_BUCKET_SLOTS]; // 0 marks a free slot
+	int32_t slots[LS_BUCKET_SLOTS]; // index of the counter in the counter array
+} LSBucket; // 64 bytes
+#endif
+
 #ifdef LS_SIZE
 #define LS_SPACE (LS_HASHMULT*LS_SIZE)
 #endif
 
-typedef struct LS_type
+/*
+A DIMSum summary of Weight sums per Item. Item needs == and a hash
+(LS_HashItem in losum.cc), Weight needs to be ordered and added.
+The instances losum.cc provides are the typedefs below.
+*/
+template<class ItemT, class WeightT>
+struct LSsummary_t
 {
-	LSweight_t n;
-	std::atomic_int blocksLeftThisUpdate, blocksLeft, quantile;
-	int nActive, nPassive, left2Move;
+	typedef ItemT Item;
+	typedef WeightT Weight;
+	typedef LScounter_t<Item, Weight> Counter;
+	typedef TKpair_t<Item, Weight> Pair; // for LS_OutputTo and LS_TopK
+	typedef TKsink_t<Item, Weight> Sink;
+#ifdef LS_BUCKETED_TABLE
+	typedef LSBucket TableEntry; // hashsize counts buckets
+#else
+	typedef int32_t TableEntry; // hashsize counts chains, holds index + 1 of
+								// the chain's first counter, 0 if it is empty
+#endif
+
+	Weight n;
+	// Sequence count for readers on other threads. Odd while the update
+	// thread changes more than it appends, as when maintenance restarts and
+	// the arrays switch roles, so that readers can tell that their copy may
+	// be torn. The fields such a change writes are atomics for them.
+	std::atomic_uint epoch;
+	std::atomic_int published; // nActive, for readers on other threads
+	std::atomic_int blocksLeft;
+	std::atomic<Weight> quantile;
+	// Maintenance progress. stepsDone is bumped by LS_FinishStep, an update
+	// that must wait for maintenance waits until it reaches stepsTarget.
+	std::atomic_uint stepsDone, stepsTarget;
+	int nActive, left2Move;
+	std::atomic_int nPassive;
 	int hasha, hashb, hashsize;
 	int size, maxMaintenanceTime;
-	int* buffer;
+	// Deamortization, see LS_SetLatencyBudget. The maintenance thread
+	// measures nsPerStep and sets slice, which is 0 for the even split.
+	std::atomic<uint64_t> latencyBudget; // set by the caller, read by that thread
+	std::atomic<double> nsPerStep;
+	std::atomic_int slice;
+	uint64_t waits, overBudget;
+	Weight* buffer; // counts copied for the quantile selection
+	Weight* scratch; // second buffer for the selection
 	int clearedFromPassive, movedFromPassive, stepsLeft, copied2Buffer;
 	float epsilon;
-	HANDLE handle, 
-		maintenanceStepSemaphore, finishUpdateSemaphore;
-	std::atomic_bool loosa, done, finishedMedian;
-	LSCounter *activeCounters;
-	LSCounter *passiveCounters;
-	LSCounter ** activeHashtable; // array of pointers to items in 'counters'
-	LSCounter ** passiveHashtable; // array of pointers to items in 'counters'
-} LS_type;
-
-extern LS_type * LS_Init(float fPhi, float gamma);
-extern void LS_Destroy(LS_type *);
-extern void LS_Update(LS_type *, LSitem_t, int);
-extern int LS_Size(LS_type *);
-extern int LS_PointEst(LS_type *, LSitem_t);
-extern int LS_PointErr(LS_type *, LSitem_t);
-extern void LS_CheckHash(LS_type * LS, int item, int hash);
-extern std::map<uint32_t, uint32_t> LS_Output(LS_type *, uint64_t thresh);
-extern int in_place_find_kth(int *v, int n, int k, int jump=1, int pivot=0);
-extern DWORD WINAPI LS_Maintenance(LPVOID lpParam);
-extern void LS_FinishStep(LS_type* LS);
\ No newline at end of file
+	float phi, gamma; // as passed to LS_Init, for LS_Merge
+	// Forward decay, see LS_SetDecay. lambda is 0 without it.
+	double lambda, landmark, lastTime;
+	std::atomic<double> passiveScale; // takes passive counts to the units of the active ones
+	std::thread* maintenanceThread; // NULL with a pool
+	MP_type * pool; // of LS_InitShared, else NULL
+	MPjob_t job; // the quantile selection, for the pool
+	QSselection_t<Weight> selection; // runs in parts with a pool
+	// Handoff words between the update thread and the maintenance thread.
+	// A side only enters the kernel after spinning, and flags it in *Sleeping
+	// so that the other side knows a wake up is needed.
+	std::atomic_int maintenanceRequests, updateWakeup;
+	std::atomic_bool maintenanceSleeping, updateSleeping;
+	std::atomic_bool done, finishedMedian;
+	std::atomic<Counter *> activeCounters;
+	std::atomic<Counter *> passiveCounters;
+	std::atomic<TableEntry *> activeHashtable; // hash table of items in 'activeCounters'
+	std::atomic<TableEntry *> passiveHashtable; // hash table of items in 'passiveCounters'
+	void * mapping; // snapshot file the arrays are in after LS_Restore, else NULL
+	size_t mappingLength;
+};
+
+/*
+The copy of a summary that a query thread works on, filled by LS_Read
+while the update thread keeps going.
+*/
+template<class S>
+struct LSreader_t
+{
+	S * LS;
+	typename S::Counter * counters; // the active counters, then the passive ones
+	int nActive, nPassive;
+	typename S::Weight quantile;
+	double passiveScale;
+	uint64_t retries; // copies that were torn by a restart and taken again
+};
+
+/*
+The deamortization policy of a summary and how it fares, see LS_GetSchedule.
+*/
+typedef struct LSschedule_t
+{
+	uint64_t latencyBudget; // ns of maintenance per update, 0 for the even split
+	double nsPerStep; // of the maintenance thread, 0 until it measured one round
+	int slice; // most steps an update waits for, 0 for the even split
+	double stepsPerUpdate; // of the even split, which gamma sets
+	double minGamma; // least gamma whose even split fits in a slice, HUGE_VAL if
+					 // none does, 0 without a slice
+	uint64_t waits; // updates that waited for the maintenance thread
+	uint64_t overBudget; // updates that had to wait for more than a slice
+} LSschedule_t;
+
+typedef LSsummary_t<LSitem_t, LSweight_t> LS_type; // 32 bit items and weights
+typedef LSsummary_t<uint32_t, uint64_t> LSBytes_type; // byte counts of 32 bit items
+typedef LSsummary_t<uint64_t, uint64_t> LS64_type;
+typedef LSsummary_t<LSKey128, uint64_t> LS128_type;
+typedef LSsummary_t<uint32_t, double> LSDecay_type; // for LS_SetDecay
+
+/*
+The weights of LS_Update may be negative in the strict turnstile model,
+where no item's count ever drops below zero, as with retractions of
+earlier updates. A retraction lowers the item's counter if it has one
+and is dropped otherwise. Estimates stay upper bounds within the quantile
+of the counts, which only grows with the positive weights, so the error
+is at most epsilon times the weight inserted rather than the net weight n.
+*/
+template<class S = LS_type> S * LS_Init(float fPhi, float gamma);
+// As LS_Init, but maintenance runs on the pool instead of a thread of the
+// summary's own. The pool must outlive the summary.
+template<class S = LS_type> S * LS_InitShared(float fPhi, float gamma, MP_type * pool);
+template<class S> void LS_Destroy(S *);
+template<class S> void LS_Update(S *, typename S::Item, typename S::Weight);
+template<class S> void LS_UpdateBatch(S *, const typename S::Item *, const typename S::Weight *, size_t);
+template<class S> int LS_Size(S *);
+template<class S> typename S::Weight LS_PointEst(S *, typename S::Item);
+template<class S> typename S::Weight LS_PointErr(S *, typename S::Item);
+template<class S> void LS_CheckHash(S * LS, int item, int hash);
+template<class S> std::map<typename S::Item, typename S::Weight> LS_Output(S *, uint64_t thresh);
+template<class S> int LS_OutputTo(S *, uint64_t thresh, typename S::Sink *);
+template<class S> int LS_TopK(S *, int k, typename S::Pair * out);
+template<class S> void LS_Maintenance(S* LS);
+template<class S> bool LS_ResetSome(S *, int * progress, int steps);
+template<class S> typename S::Counter * LS_FindItem(S *, const typename S::Item&);
+template<class S> S * LS_Merge(S *, S *);
+template<class S> S * LS_MergeAll(S **, int);
+template<class S> bool LS_Snapshot(S *, const char * path);
+template<class S = LS_type> S * LS_Restore(const char * path);
+template<class S> typename S::Weight LS_ConcurrentPointEst(S *, typename S::Item);
+template<class S> LSreader_t<S> * LS_InitReader(S *);
+template<class S> void LS_DestroyReader(LSreader_t<S> *);
+template<class S> void LS_Read(LSreader_t<S> *);
+template<class S> std::map<typename S::Item, typename S::Weight> LS_ReaderOutput(LSreader_t<S> *, uint64_t thresh);
+
+/*
+By default every update waits for an even split of the maintenance steps
+of a round, so while the quantile is selected each update hands off to
+the maintenance thread. With a latency budget an update only waits when
+the updates left could not finish the round in slices of at most the
+budget each. The maintenance thread usually runs ahead, and updates then
+do not wait at all. The slice is the budget over the time of a step, as
+the maintenance thread measured it in the last rounds. Until it measured
+one, or when gamma is too small for the budget, the even split is used.
+*/
+template<class S> void LS_SetLatencyBudget(S *, uint64_t ns);
+template<class S> void LS_GetSchedule(S *, LSschedule_t *);
+
+/*
+Forward decay: an update of weight w at time t counts w * exp(-lambda * (T - t))
+at time T. LS_UpdateDecayed adds w * exp(lambda * (t - landmark)) instead,
+which keeps the counts in proportion, and a query at T divides by
+LS_DecayScale(T). When maintenance restarts with counts in the new active
+array grown past 2^LS_DECAY_BITS times the weights, the landmark moves
+up. The passive counts are rescaled as maintenance reads them. A stream
+with few distinct items may not restart for ever, so once the counts grew
+past 2^(2 LS_DECAY_BITS) an update rescales the active counters in place.
+Times must not go back. Only summaries of floating point weights, as
+LSDecay_type, provide these.
+*/
+#define LS_DECAY_BITS 64
+template<class S> void LS_SetDecay(S *, double lambda, double now);
+template<class S> double LS_DecayScale(S *, double t);
+template<class S> void LS_UpdateDecayed(S *, typename S::Item, typename S::Weight, double t);
+template<class S> typename S::Weight LS_DecayedPointEst(S *, typename S::Item, double t);
+template<class S> int LS_DecayedOutputTo(S *, double thresh, double t, typename S::Sink *);
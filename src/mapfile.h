@@ -0,0 +1,12 @@
+#pragma once
+#include <stddef.h>
+// mapfile.h -- copy on write mappings of whole files.
+// Pages are read from the file when first touched, and writes to the
+// mapping stay private to the process, so the file itself never changes.
+
+// Map the file at path. Returns NULL if it cannot be opened or mapped.
+extern void * MF_MapPrivate(const char * path, size_t * length);
+extern void MF_Unmap(void * base, size_t length);
+// Rename from to to, replacing to. A mapping of the old to stays valid,
+// except on Windows, where a mapped file cannot be replaced.
+extern bool MF_Replace(const char * from, const char * to);
@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <new>
+#include "mpool.h"
+#include "handoff.h"
+
+/*
+Claims a job popped from a queue. A job that its owner ran, or that was
+queued again after that, may still have an old entry in a queue, so
+claiming can fail.
+*/
+static bool MP_Claim(MPjob_t * job) {
+	int queued = MP_QUEUED;
+	return job->state.compare_exchange_strong(queued, MP_RUNNING);
+}
+
+static void MP_Run(MPjob_t * job) {
+	job->run(job->arg, UINT64_MAX);
+	// The job may be submitted again as soon as it ran, then it stays queued.
+	int running = MP_RUNNING;
+	job->state.compare_exchange_strong(running, MP_IDLE);
+}
+
+/*
+The next job for worker w: the oldest of its own, else the newest of
+another worker's queue. Claimed under the queue's lock, so that
+MP_Unregister never frees a job that a worker is about to claim.
+*/
+static MPjob_t * MP_Take(MP_type * MP, int w) {
+	for (int i = 0; i < MP->nWorkers; ++i) {
+		MPworker_t * victim = &MP->workers[(w + i) % MP->nWorkers];
+		std::lock_guard<std::mutex> guard(victim->lock);
+		while (!victim->queue.empty()) {
+			MPjob_t * job;
+			if (i == 0) {
+				job = victim->queue.front();
+				victim->queue.pop_front();
+			}
+			else {
+				job = victim->queue.back();
+				victim->queue.pop_back();
+			}
+			if (MP_Claim(job))
+				return job;
+		}
+	}
+	return NULL;
+}
+
+static void MP_Worker(MP_type * MP, int w) {
+	MPworker_t * worker = &MP->workers[w];
+	while (true) {
+		int seq = worker->wakeup;
+		MPjob_t * job = MP_Take(MP, w);
+		if (job) {
+			worker->busy = true;
+			MP_Run(job);
+			worker->busy = false;
+			continue;
+		}
+		if (MP->done)
+			return;
+		HO_WaitForChange(worker->wakeup, seq, worker->sleeping);
+	}
+}
+
+MP_type * MP_Init(int nWorkers)
+{
+	if (nWorkers <= 0)
+		nWorkers = (int)std::thread::hardware_concurrency();
+	if (nWorkers <= 0)
+		nWorkers = 1;
+	MP_type * result = (MP_type *)calloc(1, sizeof(MP_type));
+	result->nWorkers = nWorkers;
+	result->nextHome = 0;
+	result->done = false;
+	result->workers = (MPworker_t *)calloc(nWorkers, sizeof(MPworker_t));
+	for (int w = 0; w < nWorkers; ++w) {
+		MPworker_t * worker = &result->workers[w];
+		new (&worker->lock) std::mutex();
+		new (&worker->queue) std::deque<MPjob_t *>();
+		worker->wakeup = 0;
+		worker->sleeping = false;
+		worker->busy = false;
+	}
+	for (int w = 0; w < nWorkers; ++w)
+		result->workers[w].thread = new std::thread(MP_Worker, result, w);
+	return result;
+}
+
+void MP_Destroy(MP_type * MP)
+{
+	MP->done = true;
+	for (int w = 0; w < MP->nWorkers; ++w)
+		HO_Notify(MP->workers[w].wakeup, MP->workers[w].sleeping);
+	for (int w = 0; w < MP->nWorkers; ++w) {
+		MPworker_t * worker = &MP->workers[w];
+		worker->thread->join();
+		delete worker->thread;
+		worker->queue.~deque();
+		worker->lock.~mutex();
+	}
+	free(MP->workers);
+	free(MP);
+}
+
+void MP_Register(MP_type * MP, MPjob_t * job, bool (*run)(void *, uint64_t), void * arg)
+{
+	job->run = run;
+	job->arg = arg;
+	job->state = MP_IDLE;
+	job->home = (MP->nextHome++) % MP->nWorkers;
+}
+
+void MP_Unregister(MP_type * MP, MPjob_t * job)
+{
+	for (int w = 0; w < MP->nWorkers; ++w) {
+		MPworker_t * worker = &MP->workers[w];
+		std::lock_guard<std::mutex> guard(worker->lock);
+		for (auto it = worker->queue.begin(); it != worker->queue.end(); ) {
+			if (*it == job)
+				it = worker->queue.erase(it);
+			else
+				++it;
+		}
+	}
+	// Not in any queue now, so no worker can claim it any more.
+	int queued = MP_QUEUED;
+	job->state.compare_exchange_strong(queued, MP_IDLE);
+	while (job->state == MP_RUNNING)
+		std::this_thread::yield();
+}
+
+void MP_Submit(MP_type * MP, MPjob_t * job)
+{
+	MPworker_t * home = &MP->workers[job->home];
+	{
+		std::lock_guard<std::mutex> guard(home->lock);
+		job->state = MP_QUEUED;
+		home->queue.push_back(job);
+	}
+	HO_Notify(home->wakeup, home->sleeping);
+	if (!home->busy)
+		return;
+	// The home worker is running another job, wake one that can steal this.
+	for (int w = 0; w < MP->nWorkers; ++w) {
+		MPworker_t * worker = &MP->workers[w];
+		if (worker != home && !worker->busy) {
+			HO_Notify(worker->wakeup, worker->sleeping);
+			return;
+		}
+	}
+}
+
+bool MP_RunIfQueued(MP_type * MP, MPjob_t * job, uint64_t steps)
+{
+	if (!MP_Claim(job))
+		return false;
+	if (!job->run(job->arg, steps)) {
+		MP_Submit(MP, job);
+		return true;
+	}
+	int running = MP_RUNNING;
+	job->state.compare_exchange_strong(running, MP_IDLE);
+	return true;
+}
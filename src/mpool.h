@@ -0,0 +1,60 @@
+#pragma once
+#include <atomic>
+#include <stdint.h>
+#include <thread>
+#include <mutex>
+#include <deque>
+// mpool.h -- a pool of maintenance threads shared by many summaries.
+// A summary without a thread of its own registers a job with the pool and
+// submits it whenever its maintenance has work for another thread. Each
+// worker has a queue, a job is pushed to the queue of its home worker, and
+// a worker whose queue is empty steals from the others. The number of
+// workers follows the cores, not the summaries.
+//
+// A job runs in parts of a number of steps. A summary whose update must
+// wait for a job that no worker has started runs the update's share of it
+// itself with MP_RunIfQueued, and the rest is queued again. A busy pool so
+// never makes an update do more than its own share of the work.
+
+#define MP_IDLE 0
+#define MP_QUEUED 1
+#define MP_RUNNING 2
+
+typedef struct MPjob_t
+{
+	// Runs at most steps of the job, returns whether the job is done.
+	bool (*run)(void *, uint64_t steps);
+	void * arg;
+	std::atomic_int state; // MP_IDLE, MP_QUEUED or MP_RUNNING
+	int home; // worker whose queue the job is pushed to
+} MPjob_t;
+
+typedef struct MPworker_t
+{
+	std::mutex lock; // of queue, and of the claim of a job in it
+	std::deque<MPjob_t *> queue; // may hold jobs that were run by their owner
+	std::thread * thread;
+	std::atomic_int wakeup;
+	std::atomic_bool sleeping, busy;
+} MPworker_t;
+
+typedef struct MP_type
+{
+	int nWorkers;
+	MPworker_t * workers;
+	std::atomic_int nextHome;
+	std::atomic_bool done;
+} MP_type;
+
+// nWorkers 0 starts a worker per core. Every job must be unregistered
+// before MP_Destroy.
+extern MP_type * MP_Init(int nWorkers);
+extern void MP_Destroy(MP_type *);
+extern void MP_Register(MP_type *, MPjob_t *, bool (*run)(void *, uint64_t), void * arg);
+// Removes the job from the queues, waiting for it if it is running.
+extern void MP_Unregister(MP_type *, MPjob_t *);
+// The job must not be queued yet.
+extern void MP_Submit(MP_type *, MPjob_t *);
+// Runs at most steps of the job on the calling thread if no worker started
+// it, and queues it again if that did not finish it. Returns whether it ran.
+extern bool MP_RunIfQueued(MP_type *, MPjob_t *, uint64_t steps);
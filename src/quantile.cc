@@ -0,0 +1,28 @@
+#include <assert.h>
+#include "quantile.h"
+
+#ifdef __AVX2__
+alignas(32) int QS_LowPack[256][8];
+alignas(32) int QS_HighPack[256][8];
+
+static struct QS_PackInit {
+	QS_PackInit() {
+		for (int mask = 0; mask < 256; mask++) {
+			int lo = 0, hi = 8;
+			for (int j = 0; j < 8; j++) {
+				if (mask & (1 << j))
+					QS_LowPack[mask][lo++] = j;
+			}
+			for (int j = 7; j >= 0; j--) {
+				if (mask & (1 << j))
+					QS_HighPack[mask][--hi] = j;
+			}
+			// the remaining lanes are never read back
+			while (lo < 8)
+				QS_LowPack[mask][lo++] = 0;
+			while (hi > 0)
+				QS_HighPack[mask][--hi] = 0;
+		}
+	}
+} qsPackInit;
+#endif
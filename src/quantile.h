@@ -0,0 +1,278 @@
+#pragma once
+// quantile.h -- selection of the k-th smallest counter, used by the
+// maintenance of IMSum and DIMSum to find the new quantile.
+//
+// Median of medians, so the number of steps is linear in the worst case.
+// Unlike the old in place version every pass reads and writes contiguous
+// memory: the medians are gathered into the scratch buffer instead of
+// being read at a stride, and each partition pass copies the items smaller
+// and larger than the pivot to the two ends of the scratch buffer, after
+// which the two buffers change roles. Items equal to the pivot are not
+// kept, as the answer is the pivot if k falls among them.
+//
+// Any ordered type can be selected. For int with AVX2 the partition
+// handles QS_BLOCK items per step with a compare, a movemask and a permute
+// from a table of left packs.
+#include <assert.h>
+#include <stdint.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#define QS_BLOCK 8 // int items partitioned per step with AVX2
+// Bounds on the steps of QS_FindKth per item. The partition costs 1 (or
+// 1/QS_BLOCK) and the medians 1/5 steps per item, the two recursions shrink
+// the input to at most 9/10, plus the first partition around the guessed
+// pivot and rounding.
+#define QS_SCALAR_STEPS_PER_ITEM 14
+#define QS_VECTOR_STEPS_PER_ITEM 5
+
+// QS_Cost<T>::stepsPerItem is the bound for selecting among T's.
+template<class T> struct QS_Cost {
+	static const int stepsPerItem = QS_SCALAR_STEPS_PER_ITEM;
+};
+#ifdef __AVX2__
+template<> struct QS_Cost<int> {
+	static const int stepsPerItem = QS_VECTOR_STEPS_PER_ITEM;
+};
+#endif
+
+#ifdef _MSC_VER
+#define QS_POPCOUNT(x) __popcnt(x)
+#else
+#define QS_POPCOUNT(x) __builtin_popcount(x)
+#endif
+
+#ifdef __AVX2__
+// QS_LowPack[mask] moves the lanes set in mask to the lowest lanes,
+// QS_HighPack[mask] to the highest lanes, keeping their order.
+extern int QS_LowPack[256][8];
+extern int QS_HighPack[256][8];
+#endif
+
+struct QS_NoStep {
+	void operator()() {}
+};
+
+template<class T>
+void QS_SortSmall(T *v, int n) {
+	for (int i = 1; i < n; i++) {
+		T x = v[i];
+		int j = i;
+		for (; j > 0 && v[j - 1] > x; j--)
+			v[j] = v[j - 1];
+		v[j] = x;
+	}
+}
+
+/*
+Copies the items of v smaller than pivot to the beginning of out and the
+items larger than pivot to its end, from v[i] on, until they are all
+copied or steps ran out. Returns whether they are all copied, then lo and
+hi - n are their numbers. i, lo and hi start at 0, 0 and n.
+*/
+template<class T, class Step>
+bool QS_PartitionSome(const T *v, int n, T pivot, T *out, int &i, int &lo, int &hi,
+	uint64_t &steps, Step &step) {
+	for (; i < n; i++) {
+		if (steps == 0)
+			return false;
+		--steps;
+		step();
+		T x = v[i];
+		if (x < pivot)
+			out[lo++] = x;
+		else if (x > pivot)
+			out[--hi] = x;
+	}
+	return true;
+}
+
+#ifdef __AVX2__
+template<class Step>
+bool QS_PartitionSome(const int *v, int n, int pivot, int *out, int &i, int &lo, int &hi,
+	uint64_t &steps, Step &step) {
+	__m256i p = _mm256_set1_epi32(pivot);
+	// While two blocks are left the gap between lo and hi holds at least
+	// 2*QS_BLOCK slots, so the full width stores below only spill into it.
+	for (; n - i >= 2 * QS_BLOCK; i += QS_BLOCK) {
+		if (steps == 0)
+			return false;
+		--steps;
+		step();
+		__m256i x = _mm256_loadu_si256((const __m256i *)(v + i));
+		int less = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(p, x)));
+		int greater = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(x, p)));
+		__m256i high = _mm256_permutevar8x32_epi32(x,
+			_mm256_load_si256((const __m256i *)QS_HighPack[greater]));
+		_mm256_storeu_si256((__m256i *)(out + hi - QS_BLOCK), high);
+		hi -= QS_POPCOUNT(greater);
+		__m256i low = _mm256_permutevar8x32_epi32(x,
+			_mm256_load_si256((const __m256i *)QS_LowPack[less]));
+		_mm256_storeu_si256((__m256i *)(out + lo), low);
+		lo += QS_POPCOUNT(less);
+	}
+	for (; i < n; i++) {
+		if (i % QS_BLOCK == 0) {
+			if (steps == 0)
+				return false;
+			--steps;
+			step();
+		}
+		int x = v[i];
+		if (x < pivot)
+			out[lo++] = x;
+		else if (x > pivot)
+			out[--hi] = x;
+	}
+	return true;
+}
+#endif
+
+/*
+A selection that runs a few steps at a time, for a caller that may only
+spend its share of the work at once. The recursion on the medians is kept
+on a stack of frames, and each frame remembers how far its pass got.
+*/
+#define QS_MAX_DEPTH 16 // the medians of n items are n/5 items, and 5^16 > INT_MAX
+
+#define QS_START 0
+#define QS_MEDIANS 1
+#define QS_PARTITION 2
+
+template<class T>
+struct QSframe_t {
+	T *v, *scratch;
+	int n, k;
+	T pivot;
+	int phase; // QS_START, QS_MEDIANS or QS_PARTITION
+	int i; // items of v done by the phase
+	int m; // medians gathered
+	int lo, hi; // ends of the partition in scratch
+};
+
+template<class T>
+struct QSselection_t {
+	QSframe_t<T> frames[QS_MAX_DEPTH];
+	int depth; // 0 once the selection is done
+	T result;
+};
+
+template<class T>
+void QS_Push(QSselection_t<T> *sel, T *v, T *scratch, int n, int k, T pivot) {
+	assert(k < n);
+	assert(sel->depth < QS_MAX_DEPTH);
+	QSframe_t<T> *f = &sel->frames[sel->depth++];
+	f->v = v;
+	f->scratch = scratch;
+	f->n = n;
+	f->k = k;
+	f->pivot = pivot;
+	f->phase = QS_START;
+}
+
+/*
+Ends the top frame with its answer, which is the pivot of the frame below.
+*/
+template<class T>
+void QS_Return(QSselection_t<T> *sel, T answer) {
+	if (--(sel->depth) == 0)
+		sel->result = answer;
+	else
+		sel->frames[sel->depth - 1].pivot = answer;
+}
+
+/*
+Sets sel up to find the k-th smallest of v[0..n), with the arguments of
+QS_FindKth. Nothing is read until QS_Run.
+*/
+template<class T>
+void QS_Start(QSselection_t<T> *sel, T *v, T *scratch, int n, int k, T pivot) {
+	sel->depth = 0;
+	sel->result = 0;
+	QS_Push(sel, v, scratch, n, k, pivot);
+}
+
+/*
+Takes at most steps more steps of the selection. Returns whether it is
+done, then the answer is in sel->result.
+*/
+template<class T, class Step>
+bool QS_Run(QSselection_t<T> *sel, uint64_t steps, Step &step) {
+	while (sel->depth > 0) {
+		QSframe_t<T> *f = &sel->frames[sel->depth - 1];
+		if (f->phase == QS_START) {
+			if (f->n <= 5) {
+				if (steps == 0)
+					return false;
+				--steps;
+				step();
+				QS_SortSmall(f->v, f->n);
+				QS_Return(sel, f->v[f->k]);
+				continue;
+			}
+			f->i = 0;
+			f->m = 0;
+			f->phase = (f->pivot == 0) ? QS_MEDIANS : QS_PARTITION;
+		}
+		if (f->phase == QS_MEDIANS) {
+			for (; f->i < f->n; f->i += 5) {
+				if (steps == 0)
+					return false;
+				--steps;
+				step();
+				int quintet_size = (f->n - f->i < 5) ? (f->n - f->i) : 5;
+				T *w = &f->v[f->i];
+				QS_SortSmall(w, quintet_size);
+				f->scratch[f->m++] = w[(quintet_size - 1) / 2];
+			}
+			// The pivot is the median of the medians. 2*m <= n, so the upper
+			// part of scratch is room for the medians' scratch.
+			f->i = 0;
+			f->phase = QS_PARTITION;
+			QS_Push(sel, f->scratch, f->scratch + f->m, f->m, f->m / 2, (T)0);
+			continue;
+		}
+		if (f->i == 0) {
+			f->lo = 0;
+			f->hi = f->n;
+		}
+		if (!QS_PartitionSome(f->v, f->n, f->pivot, f->scratch, f->i, f->lo, f->hi, steps, step))
+			return false;
+		int lt = f->lo, gt = f->n - f->hi;
+		T *t = f->v;
+		if (f->k < lt) {
+			// if k is small, search for it in the beginning.
+			f->v = f->scratch;
+			f->n = lt;
+		}
+		else if (f->k >= f->n - gt) {
+			// if k is large, search for it at the end.
+			f->v = f->scratch + f->n - gt;
+			f->k -= f->n - gt;
+			f->n = gt;
+		}
+		else {
+			QS_Return(sel, f->pivot);
+			continue;
+		}
+		f->scratch = t;
+		f->pivot = 0;
+		f->phase = QS_START;
+	}
+	return true;
+}
+
+/*
+Returns the k-th smallest of v[0..n). scratch must hold n items as well,
+and the contents of both are lost. If pivot is not 0 it is used for the
+first partition instead of the median of medians. step() is called for
+every unit of work, so that a caller can account for it.
+*/
+template<class T, class Step>
+T QS_FindKth(T *v, T *scratch, int n, int k, T pivot, Step &step) {
+	QSselection_t<T> sel;
+	QS_Start(&sel, v, scratch, n, k, pivot);
+	QS_Run(&sel, UINT64_MAX, step);
+	return sel.result;
+}
@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "slosum.h"
+#include "handoff.h"
+#include "prng.h"
+
+/*
+Feeds the contiguous part of a ring that is published to the shard's
+DIMSum instance as one batch. Returns whether there was anything.
+*/
+static bool SLS_Drain(SLSShard * shard, SLSRing * ring) {
+	int tail = ring->tail.load(std::memory_order_relaxed);
+	int head = ring->head.load(std::memory_order_acquire);
+	if (head == tail)
+		return false;
+	int start = tail & (SLS_RING_SIZE - 1);
+	int n = head - tail;
+	if (n > SLS_RING_SIZE - start)
+		n = SLS_RING_SIZE - start;
+	LS_UpdateBatch(shard->ls, &ring->items[start], &ring->values[start], n);
+	HO_Store(ring->tail, tail + n, ring->producerSleeping);
+	return true;
+}
+
+/*
+The writer of a shard. Drains the rings of the producers in turn into the
+shard's DIMSum instance until SLS_Destroy sets done.
+*/
+void SLS_Writer(SLS_type * SLS, SLSShard * shard) {
+	while (true) {
+		int seq = shard->wakeup;
+		bool drained = true;
+		for (int p = 0; p < SLS->nProducers; ++p) {
+			if (SLS_Drain(shard, &shard->rings[p]))
+				drained = false;
+		}
+		if (!drained)
+			continue;
+		// the rings are drained before done is honored
+		if (SLS->done)
+			return;
+		HO_WaitForChange(shard->wakeup, seq, shard->writerSleeping);
+	}
+}
+
+SLS_type * SLS_Init(float fPhi, float gamma, int nShards, int nProducers)
+{
+	SLS_type *result = (SLS_type *)calloc(1, sizeof(SLS_type));
+	result->nShards = nShards;
+	result->nProducers = nProducers;
+	result->hasha = 433494437;
+	result->hashb = 28657; // hard coded constants, independent of the ones
+						   // the shards use for their own hash tables
+	result->done = false;
+	// new[] honors the alignas of the counters and constructs the atomics
+	result->shards = new SLSShard[nShards];
+	for (int i = 0; i < nShards; ++i) {
+		SLSShard * shard = &result->shards[i];
+		shard->ls = LS_Init(fPhi, gamma);
+		shard->rings = new SLSRing[nProducers];
+		for (int p = 0; p < nProducers; ++p) {
+			SLSRing * ring = &shard->rings[p];
+			ring->items = (LSitem_t *)calloc(SLS_RING_SIZE, sizeof(LSitem_t));
+			ring->values = (LSweight_t *)calloc(SLS_RING_SIZE, sizeof(LSweight_t));
+			ring->head = 0;
+			ring->tail = 0;
+			ring->staged = 0;
+			ring->producerSleeping = false;
+		}
+		shard->wakeup = 0;
+		shard->writerSleeping = false;
+		shard->writer = new std::thread(SLS_Writer, result, shard);
+	}
+	return result;
+}
+
+void SLS_Destroy(SLS_type * SLS)
+{ // the producers must be done by now
+	for (int p = 0; p < SLS->nProducers; ++p)
+		SLS_Flush(SLS, p);
+	SLS->done = true;
+	for (int i = 0; i < SLS->nShards; ++i) {
+		SLSShard * shard = &SLS->shards[i];
+		HO_Notify(shard->wakeup, shard->writerSleeping);
+		shard->writer->join();
+		delete shard->writer;
+		LS_Destroy(shard->ls);
+		for (int p = 0; p < SLS->nProducers; ++p) {
+			free(shard->rings[p].items);
+			free(shard->rings[p].values);
+		}
+		delete[] shard->rings;
+	}
+	delete[] SLS->shards;
+	free(SLS);
+}
+
+int SLS_Shard(SLS_type * SLS, LSitem_t item)
+{ // the shard that owns item
+	return (int)(hash31(SLS->hasha, SLS->hashb, item) % SLS->nShards);
+}
+
+/*
+Make the staged updates of a producer visible to the writer of the shard.
+*/
+static void SLS_Publish(SLSShard * shard, SLSRing * ring) {
+	if (ring->head.load(std::memory_order_relaxed) != ring->staged) {
+		ring->head.store(ring->staged, std::memory_order_release);
+		HO_Notify(shard->wakeup, shard->writerSleeping);
+	}
+}
+
+static void SLS_Push(SLSShard * shard, SLSRing * ring, LSitem_t item, LSweight_t value) {
+	if (ring->staged - ring->tail.load(std::memory_order_acquire) == SLS_RING_SIZE) {
+		// The ring is full. Let the writer see everything and wait for room.
+		SLS_Publish(shard, ring);
+		while (true) {
+			int tail = ring->tail;
+			if (ring->staged - tail < SLS_RING_SIZE)
+				break;
+			HO_WaitForChange(ring->tail, tail, ring->producerSleeping);
+		}
+	}
+	int i = ring->staged & (SLS_RING_SIZE - 1);
+	ring->items[i] = item;
+	ring->values[i] = value;
+	++(ring->staged);
+}
+
+void SLS_Update(SLS_type * SLS, LSitem_t item, LSweight_t value, int producer)
+{
+	SLSShard * shard = &SLS->shards[SLS_Shard(SLS, item)];
+	SLS_Push(shard, &shard->rings[producer], item, value);
+	SLS_Publish(shard, &shard->rings[producer]);
+}
+
+void SLS_UpdateBatch(SLS_type * SLS, const LSitem_t * items, const LSweight_t * values, size_t n,
+	int producer)
+{
+	for (size_t i = 0; i < n; ++i) {
+		SLSShard * shard = &SLS->shards[SLS_Shard(SLS, items[i])];
+		SLS_Push(shard, &shard->rings[producer], items[i], values[i]);
+	}
+	// wake each writer once for the whole batch
+	for (int i = 0; i < SLS->nShards; ++i) {
+		SLS_Publish(&SLS->shards[i], &SLS->shards[i].rings[producer]);
+	}
+}
+
+void SLS_Flush(SLS_type * SLS, int producer)
+{ // wait until every writer has applied all updates of the producer so far
+	for (int i = 0; i < SLS->nShards; ++i) {
+		SLSShard * shard = &SLS->shards[i];
+		SLSRing * ring = &shard->rings[producer];
+		SLS_Publish(shard, ring);
+		while (true) {
+			int tail = ring->tail;
+			if (tail == ring->staged)
+				break;
+			HO_WaitForChange(ring->tail, tail, ring->producerSleeping);
+		}
+	}
+}
+
+int SLS_Size(SLS_type * SLS)
+{ // return the size of the data structure in bytes
+	int size = sizeof(SLS_type) + SLS->nShards * (sizeof(SLSShard)
+		+ SLS->nProducers * (sizeof(SLSRing)
+			+ SLS_RING_SIZE * (sizeof(LSitem_t) + sizeof(LSweight_t)))); // rings
+	for (int i = 0; i < SLS->nShards; ++i) {
+		size += LS_Size(SLS->shards[i].ls);
+	}
+	return size;
+}
+
+LSweight_t SLS_PointEst(SLS_type * SLS, LSitem_t item)
+{ // estimate the count of a particular item
+	return LS_PointEst(SLS->shards[SLS_Shard(SLS, item)].ls, item);
+}
+
+LSweight_t SLS_PointErr(SLS_type * SLS, LSitem_t item)
+{ // estimate the worst case error in the estimate of a particular item
+	return LS_PointErr(SLS->shards[SLS_Shard(SLS, item)].ls, item);
+}
+
+std::map<LSitem_t, LSweight_t> SLS_Output(SLS_type * SLS, uint64_t thresh)
+{
+	std::map<LSitem_t, LSweight_t> res;
+	LS_type::Sink sink = TK_Visitor(TK_Insert<LSitem_t, LSweight_t>, &res);
+	SLS_OutputTo(SLS, thresh, &sink);
+	return res;
+}
+
+int SLS_OutputTo(SLS_type * SLS, uint64_t thresh, LS_type::Sink * sink)
+{ // shards hold disjoint items, so one sink collects them all
+	for (int i = 0; i < SLS->nShards; ++i) {
+		LS_OutputTo(SLS->shards[i].ls, thresh, sink);
+	}
+	return sink->n;
+}
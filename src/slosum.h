@@ -0,0 +1,56 @@
+#pragma once
+#include "losum.h"
+#include<atomic>
+#include<thread>
+// slosum.h -- header file for Sharded Lossy Summing
+// Items are partitioned by hash over independent DIMSum instances, each
+// updated by its own writer thread. Since every item lives in exactly one
+// shard, a shard's error of epsilon times its own weight is at most
+// epsilon times the total weight. Each producer thread has a ring to each
+// shard, so producers hash and enqueue in parallel, and the writer of a
+// shard drains the rings of all producers in turn.
+
+#define SLS_RING_SIZE 4096 // pending updates per shard, a power of two
+
+typedef struct SLSring_t
+{
+	LSitem_t* items; // updates of one producer waiting for the writer
+	LSweight_t* values;
+	// head is only written by the producer, tail only by the writer
+	alignas(64) std::atomic_int head;
+	alignas(64) std::atomic_int tail;
+	std::atomic_bool producerSleeping;
+	alignas(64) int staged; // producer's head, before it is published
+} SLSRing;
+
+typedef struct SLSshard_t
+{
+	LS_type* ls;
+	std::thread* writer;
+	SLSRing* rings; // one per producer
+	alignas(64) std::atomic_int wakeup; // bumped when items are published, or on shutdown
+	std::atomic_bool writerSleeping;
+} SLSShard;
+
+typedef struct SLS_type
+{
+	int nShards, nProducers;
+	int hasha, hashb; // must differ from the hash used inside the shards
+	std::atomic_bool done;
+	SLSShard* shards;
+} SLS_type;
+
+// Updates of producer p, 0 <= p < nProducers, must come from one thread at
+// a time. Queries must only run after every producer's SLS_Flush, from a
+// thread that the producers handed over to.
+extern SLS_type * SLS_Init(float fPhi, float gamma, int nShards, int nProducers = 1);
+extern void SLS_Destroy(SLS_type *);
+extern int SLS_Shard(SLS_type *, LSitem_t);
+extern void SLS_Update(SLS_type *, LSitem_t, LSweight_t, int producer = 0);
+extern void SLS_UpdateBatch(SLS_type *, const LSitem_t *, const LSweight_t *, size_t, int producer = 0);
+extern void SLS_Flush(SLS_type *, int producer = 0);
+extern int SLS_Size(SLS_type *);
+extern LSweight_t SLS_PointEst(SLS_type *, LSitem_t);
+extern LSweight_t SLS_PointErr(SLS_type *, LSitem_t);
+extern std::map<LSitem_t, LSweight_t> SLS_Output(SLS_type *, uint64_t thresh);
+extern int SLS_OutputTo(SLS_type *, uint64_t thresh, LS_type::Sink *);
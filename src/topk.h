@@ -0,0 +1,125 @@
+#pragma once
+#include <stdint.h>
+#include <map>
+#include <algorithm>
+// topk.h -- results of heavy hitter queries without a std::map.
+//
+// A threshold query reports every item whose count reaches the threshold
+// to a sink. The sink copies the items to a flat buffer of the caller
+// while there is room, and calls a visitor if it has one, so a query does
+// not allocate anything. n counts every item reported, so a caller whose
+// buffer was too small can tell by how much.
+//
+// A top-k query keeps the k largest counts seen so far in the caller's
+// buffer as a heap with the smallest count on top. A counter only costs
+// more than a compare if it beats that count, and at the end the heap is
+// sorted by count, largest first.
+
+template<class Item, class Weight>
+struct TKpair_t
+{
+	Item item;
+	Weight count;
+};
+
+template<class Item, class Weight>
+struct TKsink_t
+{
+	TKpair_t<Item, Weight> * out; // filled in the order items are reported
+	int max; // room in out
+	int n; // items reported so far, may exceed max
+	void (*visit)(void * ctx, Item item, Weight count); // called on every item if not NULL
+	void * ctx;
+};
+
+typedef TKpair_t<uint32_t, uint32_t> TKPair;
+typedef TKsink_t<uint32_t, uint32_t> TKSink;
+
+template<class Item, class Weight>
+TKsink_t<Item, Weight> TK_Buffer(TKpair_t<Item, Weight> * out, int max)
+{
+	TKsink_t<Item, Weight> sink = { out, max, 0, NULL, NULL };
+	return sink;
+}
+
+template<class Item, class Weight>
+TKsink_t<Item, Weight> TK_Visitor(void (*visit)(void *, Item, Weight), void * ctx)
+{
+	TKsink_t<Item, Weight> sink = { NULL, 0, 0, visit, ctx };
+	return sink;
+}
+
+template<class Item, class Weight, class Count>
+inline void TK_Report(TKsink_t<Item, Weight> * sink, Item item, Count count)
+{
+	if (sink->n < sink->max) {
+		sink->out[sink->n].item = item;
+		sink->out[sink->n].count = (Weight)count;
+	}
+	if (sink->visit)
+		sink->visit(sink->ctx, item, (Weight)count);
+	sink->n++;
+}
+
+// A visitor that inserts into the std::map<Item, Weight> ctx, for the
+// *_Output functions that still return one.
+template<class Item, class Weight>
+void TK_Insert(void * ctx, Item item, Weight count)
+{
+	((std::map<Item, Weight> *)ctx)->insert(std::make_pair(item, count));
+}
+
+struct TK_Larger {
+	template<class P>
+	bool operator()(const P& x, const P& y) const { return x.count > y.count; }
+};
+
+/*
+Whether a counter of count would enter the top k in top[0..n).
+*/
+template<class Item, class Weight, class Count>
+inline bool TK_Admits(const TKpair_t<Item, Weight> * top, int n, int k, Count count)
+{
+	return n < k || (Weight)count > top[0].count;
+}
+
+/*
+Offers item to the top k in top[0..n), which must have room for k pairs.
+*/
+template<class Item, class Weight, class Count>
+inline void TK_Offer(TKpair_t<Item, Weight> * top, int& n, int k, Item item, Count count)
+{
+	if (!TK_Admits(top, n, k, count))
+		return;
+	if (n == k)
+		std::pop_heap(top, top + n--, TK_Larger());
+	top[n].item = item;
+	top[n].count = (Weight)count;
+	std::push_heap(top, top + ++n, TK_Larger());
+}
+
+/*
+Sorts the heap of TK_Offer by count, largest first.
+*/
+template<class Item, class Weight>
+void TK_SortTop(TKpair_t<Item, Weight> * top, int n)
+{
+	std::sort_heap(top, top + n, TK_Larger());
+}
+
+/*
+Moves the k largest of the n pairs in v to its front, sorted by count,
+largest first, for results such as those of the sketches, which can only
+be found by threshold. Returns how many there are, at most k.
+*/
+template<class Item, class Weight>
+int TK_SelectTop(TKpair_t<Item, Weight> * v, int n, int k)
+{
+	if (k > n)
+		k = n;
+	if (k <= 0)
+		return 0;
+	std::nth_element(v, v + k - 1, v + n, TK_Larger());
+	std::sort(v, v + k, TK_Larger());
+	return k;
+}
@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "wlosum.h"
+
+static int WLS_ResetSteps(LS_type * pane, uint64_t updates)
+{ // steps per update that empty a pane in this many updates
+	return (int)((2 * (uint64_t)pane->hashsize + updates - 1) / updates);
+}
+
+WLS_type * WLS_Init(float fPhi, float gamma, int nPanes, uint64_t paneLength, int clock)
+{
+	WLS_type *result = (WLS_type *)calloc(1, sizeof(WLS_type));
+	result->nPanes = nPanes;
+	result->clock = clock;
+	result->paneLength = paneLength;
+	result->paneStart = 0;
+	result->paneCount = 0;
+	result->started = false;
+	result->panes = (LS_type **)calloc(nPanes + 2, sizeof(LS_type *));
+	for (int i = 0; i < nPanes + 2; ++i) {
+		result->panes[i] = LS_Init(fPhi, gamma);
+	}
+	result->current = 0;
+	result->dirty = 0;
+	result->resetProgress = 0;
+	result->pendingSlides = 0;
+	// Emptying a pane clears its two tables. Spread that over the updates
+	// of a pane, or over the updates between two maintenance restarts if
+	// the panes are timed, until a pane shows how many updates they get.
+	LS_type * pane = result->panes[0];
+	uint64_t updates = pane->size;
+	if (clock == WLS_ITEMS && paneLength < updates)
+		updates = paneLength;
+	result->resetStepsPerUpdate = WLS_ResetSteps(pane, updates);
+	return result;
+}
+
+void WLS_Destroy(WLS_type * WLS)
+{
+	for (int i = 0; i < WLS->nPanes + 2; ++i) {
+		LS_Destroy(WLS->panes[i]);
+	}
+	free(WLS->panes);
+	free(WLS);
+}
+
+static int WLS_After(WLS_type * WLS, int k)
+{ // the pane k after current in the ring
+	return (WLS->current + k) % (WLS->nPanes + 2);
+}
+
+/*
+Whether pane i is in the window. The spare and the pane being emptied are
+not, nor are the oldest panes that pending slides have expired. The
+current pane stays, as it takes the updates until the slides are made.
+*/
+static bool WLS_InWindow(WLS_type * WLS, int i)
+{
+	int after = (i - WLS->current + WLS->nPanes + 2) % (WLS->nPanes + 2);
+	int expired = std::min(WLS->pendingSlides, WLS->nPanes - 1);
+	return after == 0 || after > 2 + expired;
+}
+
+/*
+Empties the dirty panes, the one after current first, for at most steps
+steps of LS_ResetSome.
+*/
+static void WLS_RecycleSome(WLS_type * WLS, int steps)
+{
+	while (WLS->dirty > 0 && steps > 0) {
+		int before = WLS->resetProgress;
+		if (!LS_ResetSome(WLS->panes[WLS_After(WLS, 3 - WLS->dirty)], &WLS->resetProgress, steps))
+			return;
+		steps -= WLS->resetProgress - before;
+		WLS->resetProgress = 0;
+		--(WLS->dirty);
+	}
+}
+
+/*
+Makes the pending slides whose pane is empty: the spare takes the updates
+from now on and the oldest pane leaves the window, to be emptied in turn.
+At most two slides, so O(1).
+*/
+static void WLS_CatchUp(WLS_type * WLS)
+{
+	while (WLS->pendingSlides > 0 && WLS->dirty < 2) {
+		WLS->current = WLS_After(WLS, 1);
+		++(WLS->dirty);
+		--(WLS->pendingSlides);
+	}
+}
+
+/*
+Ends the current pane and slides the window by a pane, as soon as the
+spare is empty.
+*/
+static void WLS_Slide(WLS_type * WLS)
+{
+	// more slides than panes leave nothing of the window either way
+	if (WLS->pendingSlides < WLS->nPanes)
+		++(WLS->pendingSlides);
+	// A timed pane is emptied over the updates of the next two, so this
+	// keeps up as long as the rate does not drop by half from pane to pane.
+	if (WLS->clock == WLS_TIME && WLS->paneCount > 0)
+		WLS->resetStepsPerUpdate = WLS_ResetSteps(WLS->panes[0], WLS->paneCount);
+	WLS->paneCount = 0;
+	WLS_CatchUp(WLS);
+}
+
+void WLS_Advance(WLS_type * WLS, uint64_t now)
+{
+	if (WLS->clock != WLS_TIME)
+		return;
+	if (!WLS->started) {
+		WLS->paneStart = now;
+		WLS->started = true;
+		return;
+	}
+	int slides = 0;
+	while (now - WLS->paneStart >= WLS->paneLength) {
+		if (slides == WLS->nPanes) {
+			// every pane in the window is empty by now
+			WLS->paneStart = now - (now - WLS->paneStart) % WLS->paneLength;
+			break;
+		}
+		WLS_Slide(WLS);
+		WLS->paneStart += WLS->paneLength;
+		++slides;
+	}
+}
+
+void WLS_Update(WLS_type * WLS, LSitem_t item, LSweight_t value)
+{
+	if (WLS->clock == WLS_ITEMS && WLS->paneCount == WLS->paneLength)
+		WLS_Slide(WLS);
+	++(WLS->paneCount);
+	LS_Update(WLS->panes[WLS->current], item, value);
+	WLS_RecycleSome(WLS, WLS->resetStepsPerUpdate);
+	WLS_CatchUp(WLS);
+}
+
+void WLS_UpdateBatch(WLS_type * WLS, const LSitem_t * items, const LSweight_t * values, size_t n)
+{
+	size_t done = 0;
+	while (done < n) {
+		size_t m = n - done;
+		if (WLS->clock == WLS_ITEMS) {
+			// a chunk never spans two panes
+			if (WLS->paneCount == WLS->paneLength)
+				WLS_Slide(WLS);
+			if (m > WLS->paneLength - WLS->paneCount)
+				m = (size_t)(WLS->paneLength - WLS->paneCount);
+		}
+		WLS->paneCount += m;
+		LS_UpdateBatch(WLS->panes[WLS->current], items + done, values + done, m);
+		WLS_RecycleSome(WLS, (int)std::min(m * WLS->resetStepsPerUpdate, (size_t)INT_MAX));
+		WLS_CatchUp(WLS);
+		done += m;
+	}
+}
+
+int WLS_Size(WLS_type * WLS)
+{ // return the size of the data structure in bytes
+	int size = sizeof(WLS_type) + (WLS->nPanes + 2) * sizeof(LS_type *);
+	for (int i = 0; i < WLS->nPanes + 2; ++i) {
+		size += LS_Size(WLS->panes[i]);
+	}
+	return size;
+}
+
+LSweight_t WLS_PointEst(WLS_type * WLS, LSitem_t item)
+{ // estimate the count of a particular item in the window
+	LSweight_t est = 0;
+	for (int i = 0; i < WLS->nPanes + 2; ++i) {
+		if (WLS_InWindow(WLS, i))
+			est += LS_PointEst(WLS->panes[i], item);
+	}
+	return est;
+}
+
+LSweight_t WLS_PointErr(WLS_type * WLS, LSitem_t item)
+{ // estimate the worst case error in the estimate of a particular item
+	LSweight_t err = 0;
+	for (int i = 0; i < WLS->nPanes + 2; ++i) {
+		if (WLS_InWindow(WLS, i))
+			err += LS_PointErr(WLS->panes[i], item);
+	}
+	return err;
+}
+
+typedef struct WLSquery_t
+{
+	WLS_type * WLS;
+	int pane; // the pane whose candidates are visited
+	LSweight_t thresh, paneThresh;
+	LS_type::Sink * sink;
+} WLSQuery;
+
+/*
+Visits a counter of at least paneThresh in pane q->pane. Sums the item's
+estimates over the window, unless an earlier pane had it as a candidate.
+Its estimate in q->pane is count, so that pane is not searched again.
+*/
+static void WLS_Candidate(void * ctx, LSitem_t item, LSweight_t count)
+{
+	WLSQuery * q = (WLSQuery *)ctx;
+	WLS_type * WLS = q->WLS;
+	LSweight_t est = 0;
+	for (int i = 0; i < WLS->nPanes + 2; ++i) {
+		if (!WLS_InWindow(WLS, i))
+			continue;
+		if (i == q->pane) {
+			est += count;
+			continue;
+		}
+		LS_type * pane = WLS->panes[i];
+		LSCounter * c = LS_FindItem(pane, item);
+		if (c && i < q->pane && c->count >= q->paneThresh)
+			return;
+		est += c ? c->count : (LSweight_t)pane->quantile;
+	}
+	if (est >= q->thresh)
+		TK_Report(q->sink, item, est);
+}
+
+/*
+An item whose count in the window reaches thresh reaches thresh / nPanes
+in one of the panes, where its estimate is at least its count. So the
+counters above that in each pane are the only candidates.
+*/
+int WLS_OutputTo(WLS_type * WLS, uint64_t thresh, LS_type::Sink * sink)
+{
+	WLSQuery q;
+	q.WLS = WLS;
+	uint64_t paneThresh = (thresh + WLS->nPanes - 1) / WLS->nPanes;
+	q.thresh = (LSweight_t)thresh;
+	q.paneThresh = (LSweight_t)paneThresh;
+	q.sink = sink;
+	LS_type::Sink candidates = TK_Visitor(WLS_Candidate, (void *)&q);
+	for (q.pane = 0; q.pane < WLS->nPanes + 2; ++q.pane) {
+		if (WLS_InWindow(WLS, q.pane))
+			LS_OutputTo(WLS->panes[q.pane], paneThresh, &candidates);
+	}
+	return sink->n;
+}
+
+std::map<LSitem_t, LSweight_t> WLS_Output(WLS_type * WLS, uint64_t thresh)
+{
+	std::map<LSitem_t, LSweight_t> res;
+	LS_type::Sink sink = TK_Visitor(TK_Insert<LSitem_t, LSweight_t>, &res);
+	WLS_OutputTo(WLS, thresh, &sink);
+	return res;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "losum.h"
+// wlosum.h -- header file for Windowed Lossy Summing
+// Heavy hitters of the last nPanes panes of a stream, where a pane is a
+// fixed number of updates or a fixed span of the caller's clock. Every
+// pane is a DIMSum instance, and an item's estimate is the sum of its
+// estimates in the panes, so the error is at most epsilon times the
+// weight in the window. The window slides a pane at a time: it covers the
+// nPanes - 1 newest full panes and the one being filled.
+//
+// Two more panes than the window needs are kept, a spare and the one being
+// emptied. When the window slides the spare takes the updates and the
+// oldest pane is handed to LS_ResetSome, which empties it a few steps per
+// update while the next two panes fill. No update ever empties a pane at
+// once: if timed panes get so few updates that the spare is not empty
+// yet when the window slides, the slide waits until it is, and the
+// updates until then count in the pane before. The panes the waiting
+// slides expire are left out of queries meanwhile.
+
+#define WLS_ITEMS 0 // panes of paneLength updates
+#define WLS_TIME 1 // panes of paneLength ticks of the clock passed to WLS_Advance
+
+typedef struct WLS_type
+{
+	int nPanes; // panes in the window
+	int clock; // WLS_ITEMS or WLS_TIME
+	uint64_t paneLength;
+	uint64_t paneStart; // time the current pane started, for WLS_TIME
+	uint64_t paneCount; // updates in the current pane
+	bool started; // whether WLS_Advance has set paneStart
+	LS_type ** panes; // ring of nPanes + 2, the two after current are not in the window
+	int current; // the pane that takes the updates
+	int dirty; // of the two panes after current, how many, from the last, need emptying
+	int resetProgress; // of LS_ResetSome on the first of those
+	int pendingSlides; // slides waiting for the pane after current to be empty
+	int resetStepsPerUpdate;
+} WLS_type;
+
+// For WLS_TIME, WLS_Advance must be called with the time before updates
+// that belong to it. Queries cover the panes that have not expired,
+// counting slides that still wait for the spare.
+extern WLS_type * WLS_Init(float fPhi, float gamma, int nPanes, uint64_t paneLength, int clock);
+extern void WLS_Destroy(WLS_type *);
+extern void WLS_Advance(WLS_type *, uint64_t now);
+extern void WLS_Update(WLS_type *, LSitem_t, LSweight_t);
+extern void WLS_UpdateBatch(WLS_type *, const LSitem_t *, const LSweight_t *, size_t);
+extern int WLS_Size(WLS_type *);
+extern LSweight_t WLS_PointEst(WLS_type *, LSitem_t);
+extern LSweight_t WLS_PointErr(WLS_type *, LSitem_t);
+extern std::map<LSitem_t, LSweight_t> WLS_Output(WLS_type *, uint64_t thresh);
+extern int WLS_OutputTo(WLS_type *, uint64_t thresh, LS_type::Sink *);